@@ -5,6 +5,14 @@
 
 #include "zoe.h"
 
+/* with BMI2, pext extracts the relevant blockers as the slider table index
+ * directly, so no magic numbers are needed
+ */
+#if !defined(RAY_ATTACKS) && defined(__BMI2__)
+#define PEXT_ATTACKS
+#include <immintrin.h>
+#endif
+
 #define NW 0
 #define NE 1
 #define SW 2
@@ -14,9 +22,29 @@
 #define SOUTH 6
 #define WEST  7
 
+/* fixed shifts for the magic bitboard indices: every rook tile gets a 4096
+ * entry table and every bishop tile a 512 entry table.
+ */
+#define ROOK_SHIFT   (64 - 12)
+#define BISHOP_SHIFT (64 - 9)
+
+typedef struct Magic {
+    uint64_t mask;
+    uint64_t magic;
+    uint64_t *attacks;
+} Magic;
+
 static uint64_t ray[8][65];
+uint64_t between[64][64];
+uint64_t line[64][64];
+#ifndef RAY_ATTACKS
+static Magic rook_magic[64], bishop_magic[64];
+static uint64_t rook_table[64 * 4096];
+static uint64_t bishop_table[64 * 512];
+#endif
 uint64_t king_moves[64];
 uint64_t knight_moves[64];
+uint64_t pawn_attacks[2][64];
 
 /* reset the given board to the initial state */
 void reset_board(Board *board) {
@@ -62,7 +90,7 @@ void reset_board(Board *board) {
 
     board->occupied = 0xffff00000000ffffull;
 
-    /* this can be any value as long as it is consistent */
+    /* the key also depends on the game state, so reset_game() sets it */
     board->zobrist = 0;
 }
 
@@ -81,9 +109,8 @@ void clear_board(Board *board) {
 
     board->occupied = 0;
 
-    /* TODO: Set zobrist properly (change reset_board to place pieces rather
-     * than just filling them in so that zobrist 0 = empty board.
-     */
+    /* the pieces part of the key of an empty board is 0 */
+    board->zobrist = 0;
 }
 
 /* return 1 if the given board is internally consistent and 0 otherwise */
@@ -302,6 +329,21 @@ void generate_knight_moves(void) {
     }
 }
 
+/* generate the tables of tiles attacked by a pawn of each colour */
+void generate_pawn_attacks(void) {
+    int tile;
+    uint64_t bit;
+
+    for(tile = 0; tile < 64; tile++) {
+        bit = 1ull << tile;
+
+        pawn_attacks[WHITE][tile] = ((bit << 7) & ~FILE_H)
+            | ((bit << 9) & ~FILE_A);
+        pawn_attacks[BLACK][tile] = ((bit >> 9) & ~FILE_H)
+            | ((bit >> 7) & ~FILE_A);
+    }
+}
+
 /* generate the ray tables */
 void generate_rays(void) {
     int offset[8] = { 9, 7, -7, -9, 8, 1, -8, -1 };
@@ -336,19 +378,34 @@ void generate_rays(void) {
     }
 }
 
-/* generate all movement tables */
-void generate_movetables(void) {
-    generate_rays();
-    generate_king_moves();
-    generate_knight_moves();
+/* generate the tables of tiles between and in line with pairs of tiles */
+void generate_lines(void) {
+    int opposite[8] = { SE, SW, NE, NW, SOUTH, WEST, NORTH, EAST };
+    int dir, from, to;
+
+    for(from = 0; from < 64; from++) {
+        for(dir = 0; dir < 8; dir++) {
+            uint64_t tiles = ray[dir][from];
+
+            while(tiles) {
+                to = bsf(tiles);
+                tiles ^= 1ull << to;
+
+                between[from][to] = ray[dir][from] & ~ray[dir][to]
+                    & ~(1ull << to);
+                line[from][to] = ray[dir][from] | ray[opposite[dir]][from]
+                    | (1ull << from);
+            }
+        }
+    }
 }
 
-/* return the set of tiles that can be reached by a positive ray in the given
- * direction from the given tile.
+/* return the set of tiles that can be reached by a negative ray in the given
+ * direction from the given tile with the given occupancy.
  */
-uint64_t negative_ray(Board *board, int tile, int dir) {
+static uint64_t negative_ray(uint64_t occupied, int tile, int dir) {
     uint64_t tiles = ray[dir][tile];
-    uint64_t blockers = tiles & board->occupied;
+    uint64_t blockers = tiles & occupied;
 
     /* remove all tiles beyond the first blocking tile */
     tiles &= ~ray[dir][bsr(blockers)];
@@ -357,11 +414,11 @@ uint64_t negative_ray(Board *board, int tile, int dir) {
 }
 
 /* return the set of tiles that can be reached by a positive ray in the given
- * direction from the given tile.
+ * direction from the given tile with the given occupancy.
  */
-uint64_t positive_ray(Board *board, int tile, int dir) {
+static uint64_t positive_ray(uint64_t occupied, int tile, int dir) {
     uint64_t tiles = ray[dir][tile];
-    uint64_t blockers = tiles & board->occupied;
+    uint64_t blockers = tiles & occupied;
 
     /* remove all tiles beyond the first blocking tile */
     tiles &= ~ray[dir][bsf(blockers)];
@@ -369,122 +426,241 @@ uint64_t positive_ray(Board *board, int tile, int dir) {
     return tiles;
 }
 
-/* return the set of tiles a rook can move to from the given tile */
-uint64_t rook_moves(Board *board, int tile) {
-    return positive_ray(board, tile, NORTH) | positive_ray(board, tile, EAST) |
-        negative_ray(board, tile, SOUTH) | negative_ray(board, tile, WEST);
+/* return the rook attacks from the given tile by walking the rays */
+static uint64_t rook_rays(int tile, uint64_t occupied) {
+    return positive_ray(occupied, tile, NORTH)
+        | positive_ray(occupied, tile, EAST)
+        | negative_ray(occupied, tile, SOUTH)
+        | negative_ray(occupied, tile, WEST);
 }
 
-/* return the set of tiles a bishop can move to from the given tile */
-uint64_t bishop_moves(Board *board, int tile) {
-    return positive_ray(board, tile, NW) | positive_ray(board, tile, NE) |
-        negative_ray(board, tile, SW) | negative_ray(board, tile, SE);
+/* return the bishop attacks from the given tile by walking the rays */
+static uint64_t bishop_rays(int tile, uint64_t occupied) {
+    return positive_ray(occupied, tile, NW) | positive_ray(occupied, tile, NE)
+        | negative_ray(occupied, tile, SW) | negative_ray(occupied, tile, SE);
 }
 
-/* return the set of tiles the pawn can move to from the given tile */
-uint64_t pawn_moves(Board *board, int tile) {
-    int colour = !(board->b[WHITE][OCCUPIED] & (1ull << tile));
-    uint64_t move, moves = 0;
-    int x = tile % 8, y = tile / 8;
-    int target;
+#ifndef RAY_ATTACKS
+/* return the blockers that can change the attack set of a slider on the
+ * given tile; those on the edge of the board never do.
+ */
+static uint64_t relevant_blockers(int tile,
+        uint64_t (*slow_attacks)(int, uint64_t)) {
+    uint64_t edges = ((0x00000000000000ffull | 0xff00000000000000ull)
+            & ~(0xffull << (8 * (tile / 8))))
+        | ((FILE_A | FILE_H) & ~(FILE_A << (tile % 8)));
 
-    /* TODO: bitboards */
+    return slow_attacks(tile, 0) & ~edges;
+}
+#endif
 
-    /* attack left if it's an enemy */
-    if(x > 0) {
-        if(colour == WHITE)
-            target = tile + 7;
-        else
-            target = tile - 9;
+#ifdef PEXT_ATTACKS
+/* fill in the table for each tile, indexed by the relevant blockers packed
+ * together with pext
+ */
+static void generate_pext(Magic *magic, uint64_t *table, int shift,
+        uint64_t (*slow_attacks)(int, uint64_t)) {
+    int tile;
+    uint64_t occ;
 
-        move = 1ull << target;
-        if(board->b[!colour][OCCUPIED] & move)
-            moves |= move;
+    for(tile = 0; tile < 64; tile++) {
+        magic[tile].mask = relevant_blockers(tile, slow_attacks);
+        magic[tile].attacks = table + (tile << (64 - shift));
+
+        /* enumerate every subset of the mask with the carry-rippler */
+        occ = 0;
+        do {
+            magic[tile].attacks[_pext_u64(occ, magic[tile].mask)]
+                = slow_attacks(tile, occ);
+            occ = (occ - magic[tile].mask) & magic[tile].mask;
+        } while(occ);
+    }
+}
+#elif !defined(RAY_ATTACKS)
+/* return a pseudo-random number with few bits set, as these make good magic
+ * candidates; the seed is fixed so that the tables are the same every run.
+ */
+static uint64_t sparse_random(void) {
+    static uint64_t s = 1070372ull;
+    uint64_t r = 0;
+    int i;
+
+    for(i = 0; i < 3; i++) {
+        s ^= s >> 12;
+        s ^= s << 25;
+        s ^= s >> 27;
+        r = (i == 0) ? s * 2685821657736338717ull
+            : r & (s * 2685821657736338717ull);
     }
 
-    /* attack right if it's an enemy */
-    if(x < 7) {
-        if(colour == WHITE)
-            target = tile + 9;
-        else
-            target = tile - 7;
+    return r;
+}
+
+/* find a magic number for each tile such that multiplying any subset of the
+ * relevant blockers by it and shifting down gives a unique table index (or
+ * one shared only by subsets with identical attack sets), and fill in the
+ * table.
+ */
+static void generate_magic(Magic *magic, uint64_t *table, int shift,
+        uint64_t (*slow_attacks)(int, uint64_t)) {
+    static uint64_t occupancy[4096], reference[4096];
+    static int used[4096];
+    int tile, i, n, attempt;
+    uint64_t occ, idx;
+
+    for(tile = 0; tile < 64; tile++) {
+        magic[tile].mask = relevant_blockers(tile, slow_attacks);
+        magic[tile].attacks = table + (tile << (64 - shift));
+
+        /* enumerate every subset of the mask with the carry-rippler */
+        n = 0;
+        occ = 0;
+        do {
+            occupancy[n] = occ;
+            reference[n] = slow_attacks(tile, occ);
+            n++;
+            occ = (occ - magic[tile].mask) & magic[tile].mask;
+        } while(occ);
+
+        for(attempt = 1; ; attempt++) {
+            magic[tile].magic = sparse_random();
+
+            /* quickly reject magics that don't spread the high bits */
+            if(count_ones((magic[tile].mask * magic[tile].magic)
+                        & 0xff00000000000000ull) < 6)
+                continue;
+
+            for(i = 0; i < n; i++) {
+                idx = (occupancy[i] * magic[tile].magic) >> shift;
+
+                if(used[idx] != attempt) {
+                    used[idx] = attempt;
+                    magic[tile].attacks[idx] = reference[i];
+                }
+                else if(magic[tile].attacks[idx] != reference[i])
+                    break;
+            }
 
-        move = 1ull << target;
-        if(board->b[!colour][OCCUPIED] & move)
-            moves |= move;
+            if(i == n)
+                break;
+        }
+
+        /* the attempt markers are per-tile */
+        memset(used, 0, sizeof(used));
     }
+}
+#endif
 
-    /* move forward one square */
-    if(colour == WHITE)
-        target = tile + 8;
-    else
-        target = tile - 8;
-
-    move = 1ull << target;
-    if(!(board->occupied & move))
-        moves |= move;
-
-    /* try to move forward two squares if we could move one */
-    if(((y == 1 && colour == WHITE) || (y == 6 && colour == BLACK))
-            && (moves & move)) {
-        if(colour == WHITE)
-            target = tile + 16;
-        else
-            target = tile - 16;
+/* generate all movement tables */
+void generate_movetables(void) {
+    generate_rays();
+    generate_lines();
+    generate_king_moves();
+    generate_knight_moves();
+    generate_pawn_attacks();
+#if defined(PEXT_ATTACKS)
+    generate_pext(rook_magic, rook_table, ROOK_SHIFT, rook_rays);
+    generate_pext(bishop_magic, bishop_table, BISHOP_SHIFT, bishop_rays);
+#elif !defined(RAY_ATTACKS)
+    generate_magic(rook_magic, rook_table, ROOK_SHIFT, rook_rays);
+    generate_magic(bishop_magic, bishop_table, BISHOP_SHIFT, bishop_rays);
+#endif
+}
+
+/* return the set of tiles a rook on the given tile attacks with the given
+ * occupancy.
+ */
+uint64_t rook_attacks(int tile, uint64_t occupied) {
+#if defined(RAY_ATTACKS)
+    return rook_rays(tile, occupied);
+#elif defined(PEXT_ATTACKS)
+    Magic *m = rook_magic + tile;
+    return m->attacks[_pext_u64(occupied, m->mask)];
+#else
+    Magic *m = rook_magic + tile;
+    return m->attacks[((occupied & m->mask) * m->magic) >> ROOK_SHIFT];
+#endif
+}
+
+/* return the set of tiles a bishop on the given tile attacks with the given
+ * occupancy.
+ */
+uint64_t bishop_attacks(int tile, uint64_t occupied) {
+#if defined(RAY_ATTACKS)
+    return bishop_rays(tile, occupied);
+#elif defined(PEXT_ATTACKS)
+    Magic *m = bishop_magic + tile;
+    return m->attacks[_pext_u64(occupied, m->mask)];
+#else
+    Magic *m = bishop_magic + tile;
+    return m->attacks[((occupied & m->mask) * m->magic) >> BISHOP_SHIFT];
+#endif
+}
+
+/* return the set of tiles a rook can move to from the given tile */
+uint64_t rook_moves(Board *board, int tile) {
+    return rook_attacks(tile, board->occupied);
+}
 
-        move = 1ull << target;
-        if(!(board->occupied & move))
-            moves |= move;
+/* return the set of tiles a bishop can move to from the given tile */
+uint64_t bishop_moves(Board *board, int tile) {
+    return bishop_attacks(tile, board->occupied);
+}
+
+/* return the set of tiles the pawn can move to from the given tile, not
+ * including en passant captures.
+ */
+uint64_t pawn_moves(Board *board, int tile) {
+    int colour = !(board->b[WHITE][OCCUPIED] & (1ull << tile));
+    uint64_t bit = 1ull << tile;
+    uint64_t empty = ~board->occupied;
+    uint64_t push;
+
+    /* one step forward, then a second from the starting rank */
+    if(colour == WHITE) {
+        push = (bit << 8) & empty;
+        push |= ((push & RANK_3) << 8) & empty;
     }
+    else {
+        push = (bit >> 8) & empty;
+        push |= ((push & RANK_6) >> 8) & empty;
+    }
+
+    return push | (pawn_attacks[colour][tile] & board->b[!colour][OCCUPIED]);
+}
 
-    return moves;
+/* return the set of the given colour's pieces that attack the given tile,
+ * with sliders seeing through every tile not in the given occupancy.
+ */
+uint64_t attackers(Board *board, int tile, int colour, uint64_t occupied) {
+    /* a pawn attacks this tile if a pawn of the other colour here would
+     * attack it.
+     */
+    return (pawn_attacks[!colour][tile] & board->b[colour][PAWN])
+        | (knight_moves[tile] & board->b[colour][KNIGHT])
+        | (king_moves[tile] & board->b[colour][KING])
+        | (rook_attacks(tile, occupied) & (board->b[colour][ROOK]
+                    | board->b[colour][QUEEN]))
+        | (bishop_attacks(tile, occupied) & (board->b[colour][BISHOP]
+                    | board->b[colour][QUEEN]));
+}
+
+/* return 1 if the given tile is attacked by any of the given colour's pieces
+ * and 0 otherwise; the tile itself may be empty.
+ */
+int is_attacked(Board *board, int tile, int colour) {
+    return attackers(board, tile, colour, board->occupied) != 0;
 }
 
 /* return 1 if the given tile is threatened by an enemy and 0 otherwise */
 int is_threatened(Board *board, int tile) {
     int colour = !(board->b[WHITE][OCCUPIED] & (1ull << tile));
-    int x = tile % 8;
-    int pawn_tile;
 
     /* if the tile is not occupied, it is not threatened */
     if(!(board->occupied & (1ull << tile)))
         return 0;
 
-    /* pretend the piece is a rook, bishop, knight and king. if it can then
-     * take an enemy rook, bishop, knight or king respectively then it is
-     * threatened.
-     */
-    if((rook_moves(board, tile) & (board->b[!colour][ROOK]
-                    | board->b[!colour][QUEEN]))
-            || (bishop_moves(board, tile) & (board->b[!colour][BISHOP]
-                    | board->b[!colour][QUEEN]))
-            || (knight_moves[tile] & board->b[!colour][KNIGHT])
-            || (king_moves[tile] & board->b[!colour][KING]))
-        return 1;
-
-    /* check the left square from which pawns may attack */
-    if(x > 0) {
-        if(colour == WHITE)
-            pawn_tile = tile + 7;
-        else
-            pawn_tile = tile - 9;
-
-        if(board->b[!colour][PAWN] & (1ull << pawn_tile))
-            return 1;
-    }
-
-    /* check the right square from which pawns may attack */
-    if(x < 7) {
-        if(colour == WHITE)
-            pawn_tile = tile + 9;
-        else
-            pawn_tile = tile - 7;
-
-        if(board->b[!colour][PAWN] & (1ull << pawn_tile))
-            return 1;
-    }
-
-    return 0;
+    return is_attacked(board, tile, !colour);
 }
 
 /* return 1 if the given colour's king is in check and 0 otherwise */
@@ -0,0 +1,99 @@
+/* instruction set dispatch for zoe
+ *
+ * The engine is built once for each flavour in the Makefile, with each
+ * build's main() renamed to zoe_main_<flavour> and everything else made
+ * local to it. This picks the fastest flavour the CPU can run.
+ *
+ * Set ZOE_FLAVOUR to generic, popcnt or bmi2 to pick one by hand, e.g. to
+ * compare them; a flavour the CPU can't run is ignored.
+ *
+ * James Stanley 2011
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int zoe_main_generic(int argc, char **argv);
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+
+int zoe_main_popcnt(int argc, char **argv);
+int zoe_main_bmi2(int argc, char **argv);
+
+/* return 1 if the CPU has popcnt, and 0 otherwise */
+static int has_popcnt(void) {
+    unsigned a, b, c, d;
+
+    if(!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+
+    return (c & bit_POPCNT) != 0;
+}
+
+/* return 1 if the CPU has popcnt, lzcnt, BMI1 and BMI2, and 0 otherwise */
+static int has_bmi2(void) {
+    unsigned a, b, c, d;
+
+    if(!has_popcnt())
+        return 0;
+
+    if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)
+            || !(b & bit_BMI) || !(b & bit_BMI2))
+        return 0;
+
+    if(!__get_cpuid(0x80000001, &a, &b, &c, &d) || !(c & bit_LZCNT))
+        return 0;
+
+    return 1;
+}
+
+/* return 1 if pext is slow, as it is on AMD CPUs before Zen 3 (family 19h),
+ * which do it in microcode, and 0 otherwise
+ */
+static int slow_pext(void) {
+    unsigned a, b, c, d;
+    char vendor[13];
+    int family;
+
+    if(!__get_cpuid(0, &a, &b, &c, &d))
+        return 0;
+    memcpy(vendor, &b, 4);
+    memcpy(vendor + 4, &d, 4);
+    memcpy(vendor + 8, &c, 4);
+    vendor[12] = '\0';
+
+    if(strcmp(vendor, "AuthenticAMD") != 0 || !__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+
+    family = (a >> 8) & 0xf;
+    if(family == 0xf)
+        family += (a >> 20) & 0xff;
+
+    return family < 0x19;
+}
+
+int main(int argc, char **argv) {
+    char *flavour = getenv("ZOE_FLAVOUR");
+
+    if(flavour) {
+        if(strcmp(flavour, "generic") == 0)
+            return zoe_main_generic(argc, argv);
+        if(strcmp(flavour, "popcnt") == 0 && has_popcnt())
+            return zoe_main_popcnt(argc, argv);
+        if(strcmp(flavour, "bmi2") == 0 && has_bmi2())
+            return zoe_main_bmi2(argc, argv);
+    }
+
+    if(has_bmi2() && !slow_pext())
+        return zoe_main_bmi2(argc, argv);
+    if(has_popcnt())
+        return zoe_main_popcnt(argc, argv);
+    return zoe_main_generic(argc, argv);
+}
+#else
+int main(int argc, char **argv) {
+    return zoe_main_generic(argc, argv);
+}
+#endif
@@ -21,4 +21,159 @@ void reset_game(Game *game) {
     game->engine = BLACK;
     game->ep = 9;
     game->eval = 0;
+    game->nkeys = 0;
+    game->board.zobrist = compute_zobrist(game);
+}
+
+/* set up the given game from the given FEN string; return 1 on success and 0
+ * if the FEN could not be parsed. castling rights and en passant files that
+ * the board doesn't allow are dropped.
+ */
+int load_fen(Game *game, const char *fen) {
+    static char *piece_letter = "PNBRQK";
+    Board *board = &(game->board);
+    char *p;
+    int x = 0, y = 7;
+    int tile, piece, colour, rank;
+
+    reset_game(game);
+    clear_board(board);
+    game->eval = 0;
+    game->quiet_moves = 0;
+
+    /* piece placement, from a8 to h1 */
+    for(; *fen && *fen != ' '; fen++) {
+        if(*fen == '/') {
+            if(x != 8 || y == 0)
+                return 0;
+            x = 0;
+            y--;
+        }
+        else if(*fen >= '1' && *fen <= '8') {
+            x += *fen - '0';
+            if(x > 8)
+                return 0;
+        }
+        else if((p = strchr(piece_letter, *fen & ~0x20))) {
+            if(x > 7 || y < 0)
+                return 0;
+
+            piece = p - piece_letter;
+            colour = (*fen >= 'a') ? BLACK : WHITE;
+            tile = y * 8 + x;
+
+            board->mailbox[tile] = piece;
+            board->b[colour][piece] |= 1ull << tile;
+            board->b[colour][OCCUPIED] |= 1ull << tile;
+            board->occupied |= 1ull << tile;
+
+            game->eval += (colour == WHITE ? 1 : -1)
+                * piece_square_score(piece, tile, colour);
+            x++;
+        }
+        else
+            return 0;
+    }
+
+    /* every rank must have been filled */
+    if(x != 8 || y != 0)
+        return 0;
+
+    /* exactly one king each is needed for the search to make sense */
+    if(count_ones(board->b[WHITE][KING]) != 1
+            || count_ones(board->b[BLACK][KING]) != 1)
+        return 0;
+
+    /* side to move */
+    while(*fen == ' ')
+        fen++;
+    if(*fen == 'b') {
+        game->turn = BLACK;
+        game->eval = -game->eval;
+    }
+    else if(*fen != 'w')
+        return 0;
+    fen++;
+
+    /* castling rights */
+    game->can_castle[WHITE][KINGSIDE] = 0;
+    game->can_castle[WHITE][QUEENSIDE] = 0;
+    game->can_castle[BLACK][KINGSIDE] = 0;
+    game->can_castle[BLACK][QUEENSIDE] = 0;
+
+    while(*fen == ' ')
+        fen++;
+    for(; *fen && *fen != ' '; fen++) {
+        switch(*fen) {
+            case 'K': game->can_castle[WHITE][KINGSIDE] = 1;  break;
+            case 'Q': game->can_castle[WHITE][QUEENSIDE] = 1; break;
+            case 'k': game->can_castle[BLACK][KINGSIDE] = 1;  break;
+            case 'q': game->can_castle[BLACK][QUEENSIDE] = 1; break;
+            case '-': break;
+            default: return 0;
+        }
+    }
+
+    /* a right to castle needs the king and that rook on their home tiles */
+    for(colour = WHITE; colour <= BLACK; colour++) {
+        rank = colour == WHITE ? 0 : 56;
+
+        if(!(board->b[colour][KING] & (1ull << (rank + 4)))) {
+            game->can_castle[colour][KINGSIDE] = 0;
+            game->can_castle[colour][QUEENSIDE] = 0;
+        }
+        if(!(board->b[colour][ROOK] & (1ull << (rank + 7))))
+            game->can_castle[colour][KINGSIDE] = 0;
+        if(!(board->b[colour][ROOK] & (1ull << rank)))
+            game->can_castle[colour][QUEENSIDE] = 0;
+    }
+
+    /* en passant file; the tile must be on the rank the pawn that just
+     * moved two tiles passed, with that pawn in front of it.
+     */
+    while(*fen == ' ')
+        fen++;
+    game->ep = 9;
+    if(*fen >= 'a' && *fen <= 'h'
+            && fen[1] == (game->turn == WHITE ? '6' : '3')) {
+        tile = (game->turn == WHITE ? 4 : 3) * 8 + *fen - 'a';
+        if(board->b[!game->turn][PAWN] & (1ull << tile))
+            game->ep = *fen - 'a';
+    }
+
+    /* the halfmove clock is optional */
+    while(*fen && *fen != ' ')
+        fen++;
+    if(*fen)
+        game->quiet_moves = atoi(fen);
+
+    board->zobrist = compute_zobrist(game);
+
+    return 1;
+}
+
+/* return the number of times the current position has occurred before in
+ * the game; only positions since the last capture or pawn move can repeat.
+ */
+int repetitions(Game *game) {
+    int i;
+    int n = 0;
+
+    /* the keys are stored as each move is made, so the key i moves back is
+     * keys[nkeys - i]; only every other one has the same side to move.
+     */
+    for(i = 4; i <= game->quiet_moves && i <= game->nkeys; i += 2) {
+        if(game->keys[(game->nkeys - i) % KEY_HISTORY]
+                == game->board.zobrist)
+            n++;
+    }
+
+    return n;
+}
+
+/* return 1 if the search should score the current position as a draw, by
+ * the fifty move rule or because it has occurred before, and 0 otherwise.
+ */
+int is_draw(Game *game) {
+    return game->quiet_moves >= 100 || repetitions(game) > 0;
 }
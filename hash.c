@@ -4,106 +4,313 @@
  */
 
 #include "zoe.h"
+#include <sys/mman.h>
 
-uint64_t zobrist[8][64];
-HashEntry hashtable[HT_SIZE];
+/* layout of the packed data word of a hash entry */
+#define MOVE_SHIFT   0
+#define SCORE_SHIFT  16
+#define DEPTH_SHIFT  32
+#define TYPE_SHIFT   40
+#define AGE_SHIFT    42
+
+#define AGE_MASK 0x3f
+
+#define HUGE_PAGE (2 << 20)
+
+uint64_t zobrist[2][6][64];
+uint64_t zobrist_turn;
+uint64_t zobrist_castle[16];
+uint64_t zobrist_ep[8];
+static HashBucket *hashtable;
+static uint64_t hash_mask;
+static size_t hash_bytes;
+static int hash_hugetlb;
+static int hash_age;
+
+/* return the next number from a 64-bit generator with a fixed seed, so that
+ * keys (and so searches) are the same every run.
+ * http://xoshiro.di.unimi.it/splitmix64.c
+ */
+static uint64_t zobrist_random(void) {
+    static uint64_t state = 0x5a6f65ull;
+    uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
 
 /* initialise the table of zobrist numbers */
 void init_zobrist(void) {
-    int piece, square;
+    uint64_t castle[4];
+    int colour, piece, square;
     int i;
 
     /* generate the zobrist number for each piece on each square */
-    for(piece = 0; piece < 8; piece++) {
-        for(square = 0; square < 64; square++) {
-            /* fill in each byte individually; this can't fill in each short
-             * individually because RAND_MAX is only guaranteed to be at least
-             * 32767, meaning we're only guaranteed 15 bits.
-             */
-            for(i = 0; i < 8; i++)
-                zobrist[piece][square] =
-                    (zobrist[piece][square] << 8) | (random() & 0xff);
-        }
+    for(colour = 0; colour < 2; colour++)
+        for(piece = 0; piece < 6; piece++)
+            for(square = 0; square < 64; square++)
+                zobrist[colour][piece][square] = zobrist_random();
+
+    zobrist_turn = zobrist_random();
+
+    /* each combination of castling rights is the xor of the rights in it */
+    for(i = 0; i < 4; i++)
+        castle[i] = zobrist_random();
+    for(i = 0; i < 16; i++) {
+        zobrist_castle[i] = ((i & 1) ? castle[0] : 0)
+            ^ ((i & 2) ? castle[1] : 0) ^ ((i & 4) ? castle[2] : 0)
+            ^ ((i & 8) ? castle[3] : 0);
     }
 
-    /* since all of the fields in hashtable[] are initialised to 0, the first
-     * entry will appear to be the real entry for any positions with a key of 0
-     * (most notably, the initial board configuration), so we change the key
-     * of the first entry such that it doesn't match.
+    for(i = 0; i < 8; i++)
+        zobrist_ep[i] = zobrist_random();
+}
+
+/* return the zobrist key of the given game computed from scratch: the pieces,
+ * the player to move, castling rights and the en passant file.
+ */
+uint64_t compute_zobrist(Game *game) {
+    Board *board = &(game->board);
+    uint64_t key = 0;
+    int tile;
+
+    for(tile = 0; tile < 64; tile++) {
+        if(board->mailbox[tile] != EMPTY)
+            key ^= zobrist[!(board->b[WHITE][OCCUPIED] & (1ull << tile))]
+                [board->mailbox[tile]][tile];
+    }
+
+    if(game->turn == BLACK)
+        key ^= zobrist_turn;
+
+    key ^= zobrist_castle[castle_rights(game)];
+
+    if(game->ep < 8)
+        key ^= zobrist_ep[game->ep];
+
+    return key;
+}
+
+/* release the memory used by the transposition table */
+static void hash_free(void) {
+    if(hash_hugetlb)
+        munmap(hashtable, hash_bytes);
+    else
+        free(hashtable);
+
+    hashtable = NULL;
+}
+
+/* resize the transposition table to use at most the given number of
+ * megabytes, rounded down to a power of two number of buckets, and clear it;
+ * return 1 on success and 0 if the size is out of range or the memory could
+ * not be allocated, in which case the old table is kept.
+ */
+int hash_resize(size_t mb) {
+    size_t buckets = 1;
+    size_t bytes;
+    void *p, *huge;
+    int hugetlb = 0;
+
+    if(mb < 1 || mb > HT_MAX_MB)
+        return 0;
+
+    while(buckets * 2 * sizeof(HashBucket) <= (mb << 20)
+            && buckets < ((size_t)HT_MAX_MB << 20) / sizeof(HashBucket))
+        buckets *= 2;
+    bytes = buckets * sizeof(HashBucket);
+
+    /* align to the huge page size and ask for transparent huge pages, so
+     * that probes don't each cost a TLB miss.
      */
-    hashtable[0].key = 1;
+    if(posix_memalign(&p, HUGE_PAGE, bytes) != 0)
+        return 0;
+
+#ifdef MADV_HUGEPAGE
+    if(madvise(p, bytes, MADV_HUGEPAGE) != 0)
+#endif
+    {
+#ifdef MAP_HUGETLB
+        /* no transparent huge pages; try explicitly reserved ones */
+        if(bytes % HUGE_PAGE == 0) {
+            huge = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(huge != MAP_FAILED) {
+                free(p);
+                p = huge;
+                hugetlb = 1;
+            }
+        }
+#endif
+    }
+
+    if(hashtable)
+        hash_free();
+
+    hashtable = p;
+    hash_mask = buckets - 1;
+    hash_bytes = bytes;
+    hash_hugetlb = hugetlb;
+
+    hash_clear();
+
+    return 1;
 }
 
-/* store the given information in the transposition table */
-void hash_store(uint64_t key, uint8_t depth, uint8_t type, MoveScore move,
-        int colour) {
-    int index = (key % HT_SIZE);
+/* empty the transposition table */
+void hash_clear(void) {
+    memset(hashtable, 0, hash_bytes);
+    hash_age = 0;
+}
+
+/* start a new search, so that entries from older searches are preferred for
+ * replacement.
+ */
+void hash_new_search(void) {
+    hash_age = (hash_age + 1) & AGE_MASK;
+}
+
+/* return the depth of the given entry, reduced by 4 for each search it has
+ * not been used by; the lowest-valued entry in a bucket is replaced first.
+ */
+static int entry_worth(HashEntry *e) {
+    int depth = (e->data >> DEPTH_SHIFT) & 0xff;
+    int age = (e->data >> AGE_SHIFT) & AGE_MASK;
+
+    return depth - 4 * ((hash_age - age) & AGE_MASK);
+}
+
+/* mate scores count the plies from the root, but a position can be reached
+ * at any ply, so they are stored counting from the position itself.
+ */
+static int score_to_hash(int score, int ply) {
+    if(score >= INFINITY - MAX_PLY)
+        return score + ply;
+    if(score <= -INFINITY + MAX_PLY)
+        return score - ply;
+    return score;
+}
+
+/* turn a score from score_to_hash() back into one counted from the root */
+static int score_from_hash(int score, int ply) {
+    if(score >= INFINITY - MAX_PLY)
+        return score - ply;
+    if(score <= -INFINITY + MAX_PLY)
+        return score + ply;
+    return score;
+}
+
+/* store the given information for a position the given number of plies from
+ * the root in the transposition table; return 1 if it replaced an entry for
+ * another position and 0 otherwise.
+ */
+int hash_store(uint64_t key, uint8_t depth, uint8_t type, MoveScore move,
+        int ply) {
+    HashBucket *b = hashtable + (key & hash_mask);
+    HashEntry *e, *victim = b->entry;
+    uint64_t data;
+    int overwrite;
+    int i;
+
+    /* replace the entry for this position if there is one, otherwise replace
+     * the shallowest and oldest entry in the bucket.
+     */
+    for(i = 0; i < HT_BUCKET; i++) {
+        e = b->entry + i;
+        data = e->data;
+
+        if((e->key ^ data) == key && data) {
+            victim = e;
 
-    /* store scores for white player, by inverting things if we are black */
-    if(colour == BLACK) {
-        move.score = -move.score;
+            /* keep the old best move if we don't have a new one */
+            if(move.move == NOMOVE)
+                move.move = (Move)(data >> MOVE_SHIFT);
+            break;
+        }
 
-        if(type == ATLEAST)
-            type = ATMOST;
-        else if(type == ATMOST)
-            type = ATLEAST;
+        if(entry_worth(e) < entry_worth(victim))
+            victim = e;
     }
 
-    /* always replace the existing hashtable entry */
-    hashtable[index].key = key;
-    hashtable[index].depth = depth;
-    hashtable[index].type = type;
-    hashtable[index].move = move;
-    hashtable[index].colour = colour;
+    /* note whether another position's entry is being thrown away */
+    overwrite = i == HT_BUCKET && victim->data;
+
+    /* scores are stored for the player to move, who is part of the key, so
+     * there is no need to invert them.
+     */
+    data = ((uint64_t)move.move << MOVE_SHIFT)
+        | ((uint64_t)(uint16_t)score_to_hash(move.score, ply) << SCORE_SHIFT)
+        | ((uint64_t)depth << DEPTH_SHIFT)
+        | ((uint64_t)type << TYPE_SHIFT)
+        | ((uint64_t)hash_age << AGE_SHIFT);
+
+    /* no locking: a reader that sees the key from one store and the data from
+     * another just gets a key mismatch.
+     */
+    victim->key = key ^ data;
+    victim->data = data;
+
+    return overwrite;
 }
 
-/* retrieve a MoveScore from the hashtable with the given bounds on score;
- * if not suitable transposition table entry can be found, a move starting at
- * tile 64 is returned.
+/* retrieve a MoveScore for a position the given number of plies from the
+ * root from the hashtable with the given bounds on score; if not suitable
+ * transposition table entry can be found, NOMOVE is returned. if hint is not
+ * NULL, it is set to the best move stored for the position whether or not
+ * the entry was suitable, or to NOMOVE if there is none.
  */
 MoveScore hash_retrieve(uint64_t key, uint8_t depth, int alpha, int beta,
-        int colour) {
-    int index = (key % HT_SIZE);
-    MoveScore fail;
-    HashEntry e = hashtable[index];
-
-    /* scores are stored for white player */
-    if(colour == BLACK) {
-        e.move.score = -e.move.score;
-
-        if(e.type == ATLEAST)
-            e.type = ATMOST;
-        else if(e.type == ATMOST)
-            e.type = ATLEAST;
-    }
+        int ply, Move *hint) {
+    HashBucket *b = hashtable + (key & hash_mask);
+    HashEntry e;
+    MoveScore fail, found;
+    uint64_t data = 0;
+    int type;
+    int i;
 
-    /* set the start and tile of the "failure" move to be invalid */
-    fail.move.begin = 64;
-    fail.move.end = 64;
+    fail.move = NOMOVE;
 
-    /* if the colour is wrong, we don't want the result */
-    if(e.colour != colour)
-        return fail;
+    /* find the entry with the right key; an entry with no data is empty.
+     * each entry is copied before checking it so that another thread can't
+     * change it between the check and the use.
+     */
+    for(i = 0; i < HT_BUCKET; i++) {
+        e = b->entry[i];
+
+        if((e.key ^ e.data) == key && e.data) {
+            data = e.data;
+            break;
+        }
+    }
 
-    /* if the key is wrong, the board is wrong */
-    if(e.key != key)
+    found.move = (Move)(data >> MOVE_SHIFT);
+    if(hint)
+        *hint = found.move;
+
+    if(!data)
         return fail;
 
     /* if the cached search wasn't deep enough, we don't want it */
-    if(e.depth < depth)
+    if(((data >> DEPTH_SHIFT) & 0xff) < depth)
         return fail;
 
+    found.score = score_from_hash((int16_t)(data >> SCORE_SHIFT), ply);
+    found.pv[0] = found.move;
+    found.pv[1] = NOMOVE;
+    type = (data >> TYPE_SHIFT) & 0x3;
+
     /* if we know the exact score, return it */
-    if(e.type == EXACTLY)
-        return e.move;
+    if(type == EXACTLY)
+        return found;
 
     /* if we have a lower bound that is not lower than beta, return it. */
-    if(e.type == ATLEAST && e.move.score >= beta)
-        return e.move;
+    if(type == ATLEAST && found.score >= beta)
+        return found;
 
     /* if we have an upper bound that is not higher than alpha, return it */
-    if(e.type == ATMOST && e.move.score <= alpha)
-        return e.move;
+    if(type == ATMOST && found.score <= alpha)
+        return found;
 
     /* if all else fails, fail */
     return fail;
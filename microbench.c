@@ -0,0 +1,325 @@
+/* micro-benchmarks of the board and move primitives for zoe
+ *
+ * Built and run with "make bench-micro". Each primitive is timed over the
+ * bench positions and every position one move after them, so that the
+ * inputs look like the ones the search sees.
+ *
+ * James Stanley 2011
+ */
+
+#include <math.h>
+#include <time.h>
+
+/* math.h has an INFINITY of its own, which isn't the one wanted here */
+#undef INFINITY
+#include "zoe.h"
+
+/* untimed runs before the timed ones, and timed runs to take the mean and
+ * standard deviation over
+ */
+#define WARMUP 2
+#define REPEAT 10
+
+/* each timed run goes over the sample this many times */
+#define PASSES 20
+
+#define MAX_SAMPLE 4096
+
+static Game sample[MAX_SAMPLE];
+static int nsample;
+
+/* the non-empty bitboards of every sample position, for the bit scans */
+static uint64_t bitboards[MAX_SAMPLE * 14];
+static int nbitboards;
+
+/* results are added in here so that the compiler can't drop the work */
+static volatile uint64_t sink;
+
+/* return the time in nanoseconds from some fixed point */
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* fill the sample with the bench positions and their children */
+static void build_sample(void) {
+    Move moves[MAX_MOVES];
+    int nmoves;
+    Game game;
+    int i, j, c, p;
+
+    for(i = 0; bench_fens[i] && nsample < MAX_SAMPLE; i++) {
+        if(!load_fen(&game, bench_fens[i]))
+            continue;
+        sample[nsample++] = game;
+
+        generate_movelist(&game, moves, &nmoves);
+        for(j = 0; j < nmoves && nsample < MAX_SAMPLE; j++) {
+            sample[nsample] = game;
+            apply_move(sample + nsample, moves[j], NULL);
+            nsample++;
+        }
+    }
+
+    for(i = 0; i < nsample; i++)
+        for(c = 0; c < 2; c++)
+            for(p = 0; p < 7; p++)
+                if(sample[i].board.b[c][p])
+                    bitboards[nbitboards++] = sample[i].board.b[c][p];
+}
+
+/* each of these runs one pass of a primitive over the sample and returns
+ * the number of operations done
+ */
+static uint64_t run_bsf(void) {
+    uint64_t s = 0;
+    int i;
+
+    for(i = 0; i < nbitboards; i++)
+        s += bsf(bitboards[i]);
+
+    sink += s;
+    return nbitboards;
+}
+
+static uint64_t run_bsr(void) {
+    uint64_t s = 0;
+    int i;
+
+    for(i = 0; i < nbitboards; i++)
+        s += bsr(bitboards[i]);
+
+    sink += s;
+    return nbitboards;
+}
+
+static uint64_t run_count_ones(void) {
+    uint64_t s = 0;
+    int i;
+
+    for(i = 0; i < nbitboards; i++)
+        s += count_ones(bitboards[i]);
+
+    sink += s;
+    return nbitboards;
+}
+
+static uint64_t run_rook_moves(void) {
+    uint64_t s = 0;
+    int i, tile;
+
+    for(i = 0; i < nsample; i++)
+        for(tile = 0; tile < 64; tile++)
+            s ^= rook_moves(&(sample[i].board), tile);
+
+    sink += s;
+    return (uint64_t)nsample * 64;
+}
+
+static uint64_t run_bishop_moves(void) {
+    uint64_t s = 0;
+    int i, tile;
+
+    for(i = 0; i < nsample; i++)
+        for(tile = 0; tile < 64; tile++)
+            s ^= bishop_moves(&(sample[i].board), tile);
+
+    sink += s;
+    return (uint64_t)nsample * 64;
+}
+
+static uint64_t run_is_threatened(void) {
+    uint64_t s = 0, occupied;
+    uint64_t n = 0;
+    int i;
+
+    /* is_threatened() is asked about occupied tiles */
+    for(i = 0; i < nsample; i++) {
+        occupied = sample[i].board.occupied;
+        while(occupied) {
+            s += is_threatened(&(sample[i].board), bsf(occupied));
+            occupied &= occupied - 1;
+            n++;
+        }
+    }
+
+    sink += s;
+    return n;
+}
+
+static uint64_t run_generate_movelist(void) {
+    Move moves[MAX_MOVES];
+    int nmoves;
+    uint64_t s = 0;
+    int i;
+
+    for(i = 0; i < nsample; i++) {
+        generate_movelist(sample + i, moves, &nmoves);
+        s += nmoves;
+    }
+
+    sink += s;
+    return nsample;
+}
+
+static uint64_t run_generate_captures(void) {
+    Move moves[MAX_MOVES];
+    int nmoves;
+    uint64_t s = 0;
+    int i;
+
+    for(i = 0; i < nsample; i++) {
+        generate_captures(sample + i, moves, &nmoves);
+        s += nmoves;
+    }
+
+    sink += s;
+    return nsample;
+}
+
+/* apply_move() and unmake_move() are timed together, as the search uses
+ * them
+ */
+static uint64_t run_apply_move(void) {
+    Move moves[MAX_MOVES];
+    int nmoves;
+    Undo undo;
+    uint64_t s = 0, n = 0;
+    int i, j;
+
+    for(i = 0; i < nsample; i += 8) {
+        generate_movelist(sample + i, moves, &nmoves);
+        for(j = 0; j < nmoves; j++) {
+            apply_move(sample + i, moves[j], &undo);
+            s += sample[i].board.zobrist;
+            unmake_move(sample + i, moves[j], &undo);
+        }
+        n += nmoves;
+    }
+
+    sink += s;
+    return n;
+}
+
+static uint64_t run_piece_square_score(void) {
+    Board *board;
+    uint64_t s = 0, n = 0;
+    int i, tile;
+
+    for(i = 0; i < nsample; i++) {
+        board = &(sample[i].board);
+        for(tile = 0; tile < 64; tile++) {
+            if(board->mailbox[tile] == EMPTY)
+                continue;
+            s += piece_square_score(board->mailbox[tile], tile,
+                    !(board->b[WHITE][OCCUPIED] & (1ull << tile)));
+            n++;
+        }
+    }
+
+    sink += s;
+    return n;
+}
+
+static uint64_t run_hash_store(void) {
+    MoveScore m;
+    uint64_t s = 0;
+    int i;
+
+    memset(&m, 0, sizeof(m));
+    for(i = 0; i < nsample; i++) {
+        m.score = i;
+        s += hash_store(sample[i].board.zobrist, i & 15, EXACTLY, m, 0);
+    }
+
+    sink += s;
+    return nsample;
+}
+
+static uint64_t run_hash_retrieve(void) {
+    MoveScore found;
+    Move hint;
+    uint64_t s = 0;
+    int i;
+
+    /* half of the keys were stored by run_hash_store() */
+    for(i = 0; i < nsample; i++) {
+        found = hash_retrieve(sample[i].board.zobrist ^ (i & 1), 0,
+                -INFINITY, INFINITY, 0, &hint);
+        s += found.score + hint;
+    }
+
+    sink += s;
+    return nsample;
+}
+
+static struct {
+    char *name;
+    uint64_t (*run)(void);
+} benchmarks[] = {
+    { "bsf", run_bsf },
+    { "bsr", run_bsr },
+    { "count_ones", run_count_ones },
+    { "rook_moves", run_rook_moves },
+    { "bishop_moves", run_bishop_moves },
+    { "is_threatened", run_is_threatened },
+    { "generate_movelist", run_generate_movelist },
+    { "generate_captures", run_generate_captures },
+    { "apply+unmake_move", run_apply_move },
+    { "piece_square_score", run_piece_square_score },
+    { "hash_store", run_hash_store },
+    { "hash_retrieve", run_hash_retrieve },
+    { NULL, NULL }
+};
+
+/* time each primitive, printing the mean and standard deviation of the time
+ * per operation over the timed runs
+ */
+int main(int argc, char **argv) {
+    double ns[REPEAT];
+    double start, mean, var;
+    uint64_t ops;
+    int i, r, p;
+
+    init_zobrist();
+    generate_movetables();
+
+    if(!hash_resize(16)) {
+        fprintf(stderr, "%s: can't allocate hash table\n", argv[0]);
+        return 1;
+    }
+
+    build_sample();
+    printf("%d positions, %d bitboards; %d runs of %d passes each\n",
+            nsample, nbitboards, REPEAT, PASSES);
+    printf("%-20s %10s %10s\n", "primitive", "ns/op", "stddev");
+
+    for(i = 0; benchmarks[i].name; i++) {
+        for(r = 0; r < WARMUP; r++)
+            benchmarks[i].run();
+
+        for(r = 0; r < REPEAT; r++) {
+            ops = 0;
+            start = now_ns();
+            for(p = 0; p < PASSES; p++)
+                ops += benchmarks[i].run();
+            ns[r] = (now_ns() - start) / ops;
+        }
+
+        mean = 0;
+        for(r = 0; r < REPEAT; r++)
+            mean += ns[r];
+        mean /= REPEAT;
+
+        var = 0;
+        for(r = 0; r < REPEAT; r++)
+            var += (ns[r] - mean) * (ns[r] - mean);
+        var /= REPEAT;
+
+        printf("%-20s %10.2f %10.2f\n", benchmarks[i].name, mean, sqrt(var));
+    }
+
+    return 0;
+}
@@ -5,7 +5,11 @@
 
 #include "zoe.h"
 
-static int piece_score[6] = { /* pawn */ 100, /* knight */ 320,
+/* the kinds of move generate() can be asked for */
+#define GEN_CAPTURES 1
+#define GEN_QUIETS   2
+
+int piece_score[6] = { /* pawn */ 100, /* knight */ 320,
     /* bishop */ 330, /* rook */ 500, /* queen */ 900, /* king */ 0 };
 
 /* http://chessprogramming.wikispaces.com/Simplified+evaluation+function */
@@ -72,22 +76,22 @@ static int piece_square[6][64] = {
     }
 };
 
-/* return a pointer to a static char array containing the xboard representation
- * of the given move.
+/* fill the given buffer, which must have room for 6 characters, with the
+ * xboard representation of the given move, and return it; each thread
+ * passes its own buffer.
  */
-char *xboard_move(Move m) {
-    static char move[6];
+char *xboard_move(Move m, char *move) {
     int i = 0;
 
     /* start and finish co-ordinates */
-    move[i++] = 'a' + m.begin % 8;
-    move[i++] = '1' + m.begin / 8;
-    move[i++] = 'a' + m.end % 8;
-    move[i++] = '1' + m.end / 8;
-    
+    move[i++] = 'a' + MOVE_BEGIN(m) % 8;
+    move[i++] = '1' + MOVE_BEGIN(m) / 8;
+    move[i++] = 'a' + MOVE_END(m) % 8;
+    move[i++] = '1' + MOVE_END(m) / 8;
+
     /* pawn promotions */
-    if(m.promote > 0 && m.promote < 5)
-        move[i++] = ".nbrq"[m.promote];
+    if(IS_PROMOTION(m))
+        move[i++] = "nbrq"[MOVE_TYPE(m) & 3];
 
     move[i++] = '\0';
 
@@ -112,35 +116,96 @@ int is_xboard_move(const char *move) {
     return 1;
 }
 
-/* return the move for the given xboard move */
-Move get_xboard_move(const char *move) {
-    Move m;
+/* return the move in the given game for the given xboard move */
+Move get_xboard_move(Game *game, const char *move) {
+    int begin, end, promote;
 
     /* set co-ordinates */
-    m.begin = (move[0] - 'a') + ((move[1] - '1') * 8);
-    m.end = (move[2] - 'a') + ((move[3] - '1') * 8);
+    begin = (move[0] - 'a') + ((move[1] - '1') * 8);
+    end = (move[2] - 'a') + ((move[3] - '1') * 8);
 
     /* set promotion piece */
     switch(move[4]) {
-        case 'n': m.promote = KNIGHT; break;
-        case 'b': m.promote = BISHOP; break;
-        case 'r': m.promote = ROOK;   break;
-        case 'q': m.promote = QUEEN;  break;
-        default:  m.promote = 0;      break;
+        case 'n': promote = KNIGHT; break;
+        case 'b': promote = BISHOP; break;
+        case 'r': promote = ROOK;   break;
+        case 'q': promote = QUEEN;  break;
+        default:  promote = 0;      break;
     }
 
-    return m;
+    return make_move(game, begin, end, promote);
+}
+
+/* return the move between the given tiles in the given game, promoting to the
+ * given piece if it is not 0, with its type worked out from the board; the
+ * move need not be legal.
+ */
+Move make_move(Game *game, int begin, int end, int promote) {
+    Board *board = &(game->board);
+    int piece = board->mailbox[begin];
+    int type = QUIET_MOVE;
+
+    if(board->occupied & (1ull << end))
+        type = CAPTURE;
+    else if(piece == PAWN && (begin % 8) != (end % 8))
+        type = EP_CAPTURE;
+    else if(piece == PAWN && abs(begin - end) == 16)
+        type = DOUBLE_PUSH;
+    else if(piece == KING && end - begin == 2)
+        type = KING_CASTLE;
+    else if(piece == KING && begin - end == 2)
+        type = QUEEN_CASTLE;
+
+    if(promote)
+        type |= PROMOTION | (promote - KNIGHT);
+
+    return MOVE(begin, end, type);
+}
+
+/* move the given colour's piece between the given tiles without any other
+ * side effects.
+ */
+static void shift_piece(Board *board, int colour, int piece, int from,
+        int to) {
+    uint64_t bits = (1ull << from) | (1ull << to);
+
+    board->mailbox[from] = EMPTY;
+    board->mailbox[to] = piece;
+    board->b[colour][piece] ^= bits;
+    board->b[colour][OCCUPIED] ^= bits;
+    board->occupied ^= bits;
+}
+
+/* put the given colour's piece on the given empty tile */
+static void put_piece(Board *board, int colour, int piece, int tile) {
+    uint64_t bit = 1ull << tile;
+
+    board->mailbox[tile] = piece;
+    board->b[colour][piece] |= bit;
+    board->b[colour][OCCUPIED] |= bit;
+    board->occupied |= bit;
+}
+
+/* return the castling rights of the given game as a 4 bit number */
+int castle_rights(Game *game) {
+    return game->can_castle[WHITE][KINGSIDE]
+        | (game->can_castle[WHITE][QUEENSIDE] << 1)
+        | (game->can_castle[BLACK][KINGSIDE] << 2)
+        | (game->can_castle[BLACK][QUEENSIDE] << 3);
 }
 
-/* apply the given move to the given game */
-void apply_move(Game *game, Move m) {
+/* apply the given move to the given game; if undo is not NULL, fill it in
+ * with what unmake_move() needs to take the move back.
+ */
+void apply_move(Game *game, Move m, Undo *undo) {
     Board *board = &(game->board);
+    int begin, end, type;
     int beginpiece, endpiece;
-    int begincolour, endcolour;
+    int colour;
     uint64_t beginbit, endbit;
     int eptile;
     uint64_t epbit;
-    Move m2;
+    int rookbegin, rookend;
 
     /* check board consistency */
     /*if(!consistent_board(&(game->board))) {
@@ -155,128 +220,157 @@ void apply_move(Game *game, Move m) {
         exit(1);
     }*/
 
-    /* find the piece from the mailbox */
-    beginpiece = board->mailbox[m.begin];
-    endpiece = board->mailbox[m.end];
+    /* find the pieces from the mailbox; only a capture has one at the end */
+    begin = MOVE_BEGIN(m);
+    end = MOVE_END(m);
+    type = MOVE_TYPE(m);
+    beginpiece = board->mailbox[begin];
+    endpiece = (type & CAPTURE) && type != EP_CAPTURE ? board->mailbox[end]
+        : EMPTY;
+
+    /* remember the state that can't be recovered from the move */
+    if(undo) {
+        undo->captured = endpiece;
+        memcpy(undo->can_castle, game->can_castle, sizeof(undo->can_castle));
+        undo->quiet_moves = game->quiet_moves;
+        undo->ep = game->ep;
+        undo->eval = game->eval;
+        undo->zobrist = board->zobrist;
+    }
 
     /* find the bits to use */
-    beginbit = 1ull << m.begin;
-    endbit = 1ull << m.end;
+    beginbit = 1ull << begin;
+    endbit = 1ull << end;
+    colour = game->turn;
 
-    /* find out if this move is quiet */
-    if(board->occupied & endbit)
+    /* remember the key of the position being left */
+    game->keys[game->nkeys++ % KEY_HISTORY] = board->zobrist;
+
+    /* find out if this move is quiet; captures and pawn moves can't be
+     * reversed, so no position before them can occur again.
+     */
+    if((type & CAPTURE) || beginpiece == PAWN)
         game->quiet_moves = 0;
     else
         game->quiet_moves++;
 
-    /* find the colour from white's occupied bitboard */
-    begincolour = !(board->b[WHITE][OCCUPIED] & beginbit);
-    endcolour = !(board->b[WHITE][OCCUPIED] & endbit);
-
     /* delete a pawn if taken en passant */
-    if(beginpiece == PAWN && ((m.end / 8) == (5 - begincolour * 3))
-                && ((m.end % 8) == game->ep)) {
-        eptile = (4 - begincolour) * 8 + game->ep;
-        game->eval += piece_square_score(PAWN, eptile, !game->turn);
+    if(type == EP_CAPTURE) {
+        eptile = (begin & ~7) | (end & 7);
+        game->eval += piece_square_score(PAWN, eptile, !colour);
         epbit = 1ull << eptile;
         board->mailbox[eptile] = EMPTY;
         board->occupied ^= epbit;
-        board->b[!begincolour][OCCUPIED] ^= epbit;
-        board->b[!begincolour][PAWN] ^= epbit;
+        board->b[!colour][OCCUPIED] ^= epbit;
+        board->b[!colour][PAWN] ^= epbit;
+        board->zobrist ^= zobrist[!colour][PAWN][eptile];
     }
 
     /* update en passant availability */
-    if(beginpiece == PAWN && abs(m.begin - m.end) == 16)
-        game->ep = m.begin % 8;
+    if(game->ep < 8)
+        board->zobrist ^= zobrist_ep[game->ep];
+    if(type == DOUBLE_PUSH) {
+        game->ep = begin % 8;
+        board->zobrist ^= zobrist_ep[game->ep];
+    }
     else
         game->ep = 9;
 
+    /* castling rights are hashed all together, so take the old ones out */
+    board->zobrist ^= zobrist_castle[castle_rights(game)];
+
     /* remove the piece from the begin square */
-    game->eval -= piece_square_score(beginpiece, m.begin, game->turn);
-    board->mailbox[m.begin] = EMPTY;
+    game->eval -= piece_square_score(beginpiece, begin, colour);
+    board->mailbox[begin] = EMPTY;
     board->occupied ^= beginbit;
-    board->b[begincolour][beginpiece] ^= beginbit;
-    board->b[begincolour][OCCUPIED] ^= beginbit;
-    board->zobrist ^= zobrist[beginpiece][m.begin];
-    board->zobrist ^= zobrist[EMPTY][m.begin];
+    board->b[colour][beginpiece] ^= beginbit;
+    board->b[colour][OCCUPIED] ^= beginbit;
+    board->zobrist ^= zobrist[colour][beginpiece][begin];
 
     /* remove the piece from the end square if necessary */
     if(endpiece != EMPTY) {
-        game->eval += piece_square_score(endpiece, m.end, !game->turn);
-        board->b[endcolour][endpiece] ^= endbit;
-        board->b[endcolour][OCCUPIED] ^= endbit;
+        game->eval += piece_square_score(endpiece, end, !colour);
+        board->b[!colour][endpiece] ^= endbit;
+        board->b[!colour][OCCUPIED] ^= endbit;
+        board->zobrist ^= zobrist[!colour][endpiece][end];
     }
-    board->zobrist ^= zobrist[endpiece][m.end];
 
     /* change the piece to it's promotion if appropriate */
-    if(m.promote)
-        beginpiece = m.promote;
+    if(type & PROMOTION)
+        beginpiece = (type & 3) + KNIGHT;
 
     /* insert the piece at the end square */
-    game->eval += piece_square_score(beginpiece, m.end, game->turn);
-    board->mailbox[m.end] = beginpiece;
+    game->eval += piece_square_score(beginpiece, end, colour);
+    board->mailbox[end] = beginpiece;
     board->occupied |= endbit;
-    board->b[begincolour][beginpiece] |= endbit;
-    board->b[begincolour][OCCUPIED] |= endbit;
-    board->zobrist ^= zobrist[beginpiece][m.end];
+    board->b[colour][beginpiece] |= endbit;
+    board->b[colour][OCCUPIED] |= endbit;
+    board->zobrist ^= zobrist[colour][beginpiece][end];
 
     /* can't castle on one side if a rook was moved from it's original place */
     if(beginpiece == ROOK) {
         /* queenside */
-        if((m.begin == 0 && begincolour == WHITE)
-                || (m.begin == 56 && begincolour == BLACK))
-            game->can_castle[begincolour][QUEENSIDE] = 0;
+        if((begin == 0 && colour == WHITE) || (begin == 56 && colour == BLACK))
+            game->can_castle[colour][QUEENSIDE] = 0;
 
         /* kingisde */
-        if((m.begin == 7 && begincolour == WHITE)
-                || (m.begin == 63 && begincolour == BLACK))
-            game->can_castle[begincolour][KINGSIDE] = 0;
+        if((begin == 7 && colour == WHITE) || (begin == 63 && colour == BLACK))
+            game->can_castle[colour][KINGSIDE] = 0;
     }
 
     /* can't castle on one side if that rook is taken */
     if(endpiece == ROOK) {
         /* queenside */
-        if((m.end == 0 && endcolour == WHITE)
-                || (m.end == 56 && endcolour == BLACK))
-            game->can_castle[endcolour][QUEENSIDE] = 0;
+        if((end == 0 && colour == BLACK) || (end == 56 && colour == WHITE))
+            game->can_castle[!colour][QUEENSIDE] = 0;
 
         /* kingisde */
-        if((m.end == 7 && endcolour == WHITE)
-                || (m.end == 63 && endcolour == BLACK))
-            game->can_castle[endcolour][KINGSIDE] = 0;
+        if((end == 7 && colour == BLACK) || (end == 63 && colour == WHITE))
+            game->can_castle[!colour][KINGSIDE] = 0;
     }
 
+    /* can no longer castle on either side if the king is moved */
     if(beginpiece == KING) {
-        /* can no longer castle on either side if the king is moved */
-        game->can_castle[begincolour][QUEENSIDE] = 0;
-        game->can_castle[begincolour][KINGSIDE] = 0;
-
-        /* move the rook for castling */
-        if(abs(m.begin - m.end) == 2) {
-            if(m.begin > m.end) {/* queenside */
-                m2.begin = m.begin - 4;
-                m2.end = m.end + 1;
-            }
-            else {/* kingside */
-                m2.begin = m.begin + 3;
-                m2.end = m.end - 1;
-            }
-
-            /* make sure we don't try to promote */
-            m2.promote = 0;
-
-            /* apply the rook move */
-            apply_move(game, m2);
+        game->can_castle[colour][QUEENSIDE] = 0;
+        game->can_castle[colour][KINGSIDE] = 0;
+    }
 
-            /* undo the turn toggle */
-            game->turn = !game->turn;
-            game->eval = -game->eval;
+    /* move the rook for castling */
+    if(type == KING_CASTLE || type == QUEEN_CASTLE) {
+        if(type == QUEEN_CASTLE) {
+            rookbegin = begin - 4;
+            rookend = end + 1;
+        }
+        else {
+            rookbegin = begin + 3;
+            rookend = end - 1;
         }
+
+        game->eval -= piece_square_score(ROOK, rookbegin, colour);
+        game->eval += piece_square_score(ROOK, rookend, colour);
+        shift_piece(board, colour, ROOK, rookbegin, rookend);
+        board->zobrist ^= zobrist[colour][ROOK][rookbegin]
+            ^ zobrist[colour][ROOK][rookend];
     }
 
+    /* put the new castling rights in */
+    board->zobrist ^= zobrist_castle[castle_rights(game)];
+
     /* toggle current player */
     game->turn = !game->turn;
     game->eval = -game->eval;
+    board->zobrist ^= zobrist_turn;
+
+#ifdef DEBUG
+    if(board->zobrist != compute_zobrist(game)) {
+        char strmove[6];
+
+        printf("!!! Incremental key wrong after apply_move(%s)!\n",
+                xboard_move(m, strmove));
+        draw_board(board);
+        exit(1);
+    }
+#endif
 
     /* check board consistency */
     /*if(!consistent_board(&(game->board))) {
@@ -292,56 +386,360 @@ void apply_move(Game *game, Move m) {
     }*/
 }
 
-/* return a list of moves that can be played from the given position */
-void generate_movelist(Game *game, Move *movelist, int *nmoves) {
-    uint64_t pieces = game->board.b[game->turn][OCCUPIED];
-    Move m;
+/* take back the given move, which must be the last one applied to the given
+ * game with the given undo record.
+ */
+void unmake_move(Game *game, Move m, Undo *undo) {
+    Board *board = &(game->board);
+    int colour = !game->turn;
+    int begin = MOVE_BEGIN(m);
+    int end = MOVE_END(m);
+    int type = MOVE_TYPE(m);
+    int piece = board->mailbox[end];
+
+    /* move the piece back, turning a promoted piece back into a pawn */
+    shift_piece(board, colour, piece, end, begin);
+    if(type & PROMOTION) {
+        board->b[colour][piece] ^= 1ull << begin;
+        board->b[colour][PAWN] ^= 1ull << begin;
+        board->mailbox[begin] = PAWN;
+    }
+
+    /* replace the captured piece */
+    if(type == EP_CAPTURE)
+        put_piece(board, !colour, PAWN, (begin & ~7) | (end & 7));
+    else if(type & CAPTURE)
+        put_piece(board, !colour, undo->captured, end);
+
+    /* move the rook back after castling */
+    if(type == QUEEN_CASTLE)
+        shift_piece(board, colour, ROOK, end + 1, begin - 4);
+    else if(type == KING_CASTLE)
+        shift_piece(board, colour, ROOK, end - 1, begin + 3);
+
+    memcpy(game->can_castle, undo->can_castle, sizeof(game->can_castle));
+    game->quiet_moves = undo->quiet_moves;
+    game->nkeys--;
+    game->ep = undo->ep;
+    game->eval = undo->eval;
+    board->zobrist = undo->zobrist;
+    game->turn = colour;
+
+#ifdef DEBUG
+    if(!consistent_board(board) || board->zobrist != compute_zobrist(game)) {
+        char strmove[6];
+
+        printf("!!! Inconsistent board after unmake_move(%s)!\n",
+                xboard_move(m, strmove));
+        draw_board(board);
+        exit(1);
+    }
+#endif
+}
+
+/* pass the turn to the other player without moving, for null move pruning;
+ * the undo record is filled in for unmake_null_move().
+ */
+void apply_null_move(Game *game, Undo *undo) {
+    Board *board = &(game->board);
+
+    undo->quiet_moves = game->quiet_moves;
+    undo->ep = game->ep;
+    undo->zobrist = board->zobrist;
+
+    game->keys[game->nkeys++ % KEY_HISTORY] = board->zobrist;
+
+    /* a position before the null move can't count as a repetition */
+    game->quiet_moves = 0;
+
+    if(game->ep < 8)
+        board->zobrist ^= zobrist_ep[game->ep];
+    game->ep = 9;
+
+    game->turn = !game->turn;
+    game->eval = -game->eval;
+    board->zobrist ^= zobrist_turn;
+}
+
+/* take back a null move applied with the given undo record */
+void unmake_null_move(Game *game, Undo *undo) {
+    game->quiet_moves = undo->quiet_moves;
+    game->nkeys--;
+    game->ep = undo->ep;
+    game->board.zobrist = undo->zobrist;
+    game->turn = !game->turn;
+    game->eval = -game->eval;
+}
+
+/* add a move from the given tile to each of the given tiles, marking those
+ * onto the given enemy pieces as captures.
+ */
+static int add_moves(Move *movelist, int nmove, int begin, uint64_t ends,
+        uint64_t them) {
+    int end;
+
+    while(ends) {
+        end = bsf(ends);
+        ends &= ends - 1;
+
+        movelist[nmove++] = MOVE(begin, end, ((them >> end) & 1) * CAPTURE);
+    }
+
+    return nmove;
+}
+
+/* add a pawn move of the given type to each of the given tiles from the tile
+ * the given offset behind it, with each of the promotions on the last rank.
+ */
+static int add_pawn_moves(Move *movelist, int nmove, uint64_t ends,
+        int offset, int type) {
+    int promote = type | PROMOTION;
+    int begin, end;
+
+    while(ends) {
+        end = bsf(ends);
+        begin = end - offset;
+        ends &= ends - 1;
+
+        if((1ull << end) & (RANK_1 | RANK_8)) {
+            movelist[nmove++] = MOVE(begin, end, promote | (QUEEN - KNIGHT));
+            movelist[nmove++] = MOVE(begin, end, promote);
+            movelist[nmove++] = MOVE(begin, end, promote | (ROOK - KNIGHT));
+            movelist[nmove++] = MOVE(begin, end, promote | (BISHOP - KNIGHT));
+        } else
+            movelist[nmove++] = MOVE(begin, end, type);
+    }
+
+    return nmove;
+}
+
+/* generate the legal moves of the given kinds that can be played from the
+ * given position; return 1 if the player to move is in check and 0
+ * otherwise.
+ */
+static int generate(Game *game, Move *movelist, int *nmoves, int kinds) {
+    Board *board = &(game->board);
+    int colour = game->turn;
+    uint64_t us = board->b[colour][OCCUPIED];
+    uint64_t them = board->b[!colour][OCCUPIED];
+    int king = bsf(board->b[colour][KING]);
+    uint64_t checkers, pinned = 0, snipers, blockers;
+    uint64_t target, ends, pushes, moves, pieces, occupied;
+    int tile, sniper, to, eptile, type;
     int nmove = 0;
 
-    /* for each of the pieces... */
+    /* the tiles that moves of the given kinds can end on, and those pawn
+     * pushes can end on; promotions count as captures.
+     */
+    ends = ((kinds & GEN_CAPTURES) ? them : 0)
+        | ((kinds & GEN_QUIETS) ? ~board->occupied : 0);
+    pushes = ((kinds & GEN_CAPTURES) ? RANK_1 | RANK_8 : 0)
+        | ((kinds & GEN_QUIETS) ? ~(RANK_1 | RANK_8) : 0);
+
+    /* find the pieces giving check */
+    checkers = attackers(board, king, !colour, board->occupied);
+
+    /* find our pieces that are the only thing between an enemy slider and
+     * our king; looking through our own pieces finds the sliders.
+     */
+    snipers = (rook_attacks(king, them) & (board->b[!colour][ROOK]
+                | board->b[!colour][QUEEN]))
+        | (bishop_attacks(king, them) & (board->b[!colour][BISHOP]
+                | board->b[!colour][QUEEN]));
+    while(snipers) {
+        sniper = bsf(snipers);
+        snipers &= snipers - 1;
+
+        blockers = between[king][sniper] & board->occupied;
+        if(blockers && !(blockers & (blockers - 1)) && (blockers & us))
+            pinned |= blockers;
+    }
+
+    /* the king may go anywhere not attacked once it has moved off its tile,
+     * so that it can't step back along the line of a checking slider.
+     */
+    moves = king_moves[king] & ends;
+    while(moves) {
+        to = bsf(moves);
+        moves &= moves - 1;
+
+        if(!attackers(board, to, !colour, board->occupied ^ (1ull << king)))
+            nmove = add_moves(movelist, nmove, king, 1ull << to, them);
+    }
+
+    /* in double check only the king can move */
+    if(checkers & (checkers - 1)) {
+        *nmoves = nmove;
+        return 1;
+    }
+
+    /* out of check, castle if the tiles between the king and rook are empty
+     * and those the king crosses are not attacked.
+     */
+    if(!checkers && (kinds & GEN_QUIETS)) {
+        if(game->can_castle[colour][QUEENSIDE]
+                && !(board->occupied & (7ull << (king - 3)))
+                && !is_attacked(board, king - 1, !colour)
+                && !is_attacked(board, king - 2, !colour))
+            movelist[nmove++] = MOVE(king, king - 2, QUEEN_CASTLE);
+
+        if(game->can_castle[colour][KINGSIDE]
+                && !(board->occupied & (3ull << (king + 1)))
+                && !is_attacked(board, king + 1, !colour)
+                && !is_attacked(board, king + 2, !colour))
+            movelist[nmove++] = MOVE(king, king + 2, KING_CASTLE);
+    }
+
+    /* in single check, other pieces must capture the checker or block */
+    if(checkers)
+        target = checkers | between[king][bsf(checkers)];
+    else
+        target = ~us;
+
+    /* pushes and captures for all of the unpinned pawns at once */
+    pieces = board->b[colour][PAWN] & ~pinned;
+    if(colour == WHITE) {
+        moves = (pieces << 8) & ~board->occupied;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & pushes, 8,
+                QUIET_MOVE);
+        moves = ((moves & RANK_3) << 8) & ~board->occupied;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & pushes, 16,
+                DOUBLE_PUSH);
+        moves = (pieces << 7) & ~FILE_H & them;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & ends, 7,
+                CAPTURE);
+        moves = (pieces << 9) & ~FILE_A & them;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & ends, 9,
+                CAPTURE);
+    }
+    else {
+        moves = (pieces >> 8) & ~board->occupied;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & pushes, -8,
+                QUIET_MOVE);
+        moves = ((moves & RANK_6) >> 8) & ~board->occupied;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & pushes, -16,
+                DOUBLE_PUSH);
+        moves = (pieces >> 9) & ~FILE_H & them;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & ends, -9,
+                CAPTURE);
+        moves = (pieces >> 7) & ~FILE_A & them;
+        nmove = add_pawn_moves(movelist, nmove, moves & target & ends, -7,
+                CAPTURE);
+    }
+
+    /* moves for each of the other pieces, kept on the line to the king if
+     * pinned.
+     */
+    pieces = us & ~(board->b[colour][KING] | (board->b[colour][PAWN]
+                & ~pinned));
     while(pieces) {
-        /* pick the next piece */
-        int piece = bsf(pieces);
-
-        /* remove this piece from the set */
-        pieces ^= 1ull << piece;
-
-        /* set the start square of the moves */
-        m.begin = piece;
-
-        /* generate the moves for this piece */
-        uint64_t moves = generate_moves(game, piece);
-
-        /* for each of this piece's moves */
-        while(moves) {
-            /* pick the next move */
-            int move = bsf(moves);
-
-            /* remove this move from the set */
-            moves ^= 1ull << move;
-
-            /* set the end square of this move */
-            m.end = move;
-
-            /* promote pawns */
-            if(game->board.mailbox[piece] == PAWN
-                    && (m.end / 8 == 0 || m.end / 8 == 7)) {
-                m.promote = QUEEN;
-                movelist[nmove++] = m;
-                m.promote = KNIGHT;
-                movelist[nmove++] = m;
-                m.promote = ROOK;
-                movelist[nmove++] = m;
-                m.promote = BISHOP;
-                movelist[nmove++] = m;
-            } else {
-                m.promote = 0;
-                movelist[nmove++] = m;
+        tile = bsf(pieces);
+        pieces &= pieces - 1;
+
+        switch(board->mailbox[tile]) {
+        case PAWN:   moves = pawn_moves(board, tile);      break;
+        case KNIGHT: moves = knight_moves[tile];           break;
+        case BISHOP: moves = bishop_moves(board, tile);    break;
+        case ROOK:   moves = rook_moves(board, tile);      break;
+        case QUEEN:  moves = bishop_moves(board, tile)
+                         | rook_moves(board, tile);        break;
+        }
+
+        moves &= target & ~us;
+        if(pinned & (1ull << tile))
+            moves &= line[king][tile];
+
+        /* only pinned pawns get here, moving along the pin */
+        if(board->mailbox[tile] == PAWN) {
+            moves &= (them & ends) | (~them & pushes);
+
+            while(moves) {
+                to = bsf(moves);
+                moves &= moves - 1;
+
+                if(them & (1ull << to))
+                    type = CAPTURE;
+                else if(abs(to - tile) == 16)
+                    type = DOUBLE_PUSH;
+                else
+                    type = QUIET_MOVE;
+                nmove = add_pawn_moves(movelist, nmove, 1ull << to,
+                        to - tile, type);
             }
         }
+        else
+            nmove = add_moves(movelist, nmove, tile, moves & ends, them);
+    }
+
+    /* en passant captures remove two pieces from the king's lines at once,
+     * so check them by looking at the board as it would be afterwards.
+     */
+    if(game->ep < 8 && (kinds & GEN_CAPTURES)) {
+        to = (5 - colour * 3) * 8 + game->ep;
+        eptile = (4 - colour) * 8 + game->ep;
+
+        /* our pawns that attack the tile the pawn that just moved passed */
+        pieces = board->b[colour][PAWN] & pawn_attacks[!colour][to];
+
+        while(pieces) {
+            tile = bsf(pieces);
+            pieces &= pieces - 1;
+
+            occupied = board->occupied ^ (1ull << tile) ^ (1ull << eptile)
+                ^ (1ull << to);
+            if(!(attackers(board, king, !colour, occupied)
+                        & them & ~(1ull << eptile)))
+                movelist[nmove++] = MOVE(tile, to, EP_CAPTURE);
+        }
     }
 
     *nmoves = nmove;
+
+    return checkers != 0;
+}
+
+/* generate the list of legal moves that can be played from the given
+ * position; return 1 if the player to move is in check and 0 otherwise.
+ */
+int generate_movelist(Game *game, Move *movelist, int *nmoves) {
+    return generate(game, movelist, nmoves, GEN_CAPTURES | GEN_QUIETS);
+}
+
+/* generate only the legal captures and promotions, as generate_movelist()
+ * does.
+ */
+int generate_captures(Game *game, Move *movelist, int *nmoves) {
+    return generate(game, movelist, nmoves, GEN_CAPTURES);
+}
+
+/* generate only the legal moves that are neither captures nor promotions,
+ * as generate_movelist() does.
+ */
+int generate_quiets(Game *game, Move *movelist, int *nmoves) {
+    return generate(game, movelist, nmoves, GEN_QUIETS);
+}
+
+/* return 1 if the given move, which must be one the piece on its begin tile
+ * could make, doesn't leave the player's king in check and 0 otherwise.
+ */
+int is_legal_move(Game *game, Move m) {
+    Board *board = &(game->board);
+    int colour = game->turn;
+    int begin = MOVE_BEGIN(m);
+    int end = MOVE_END(m);
+    uint64_t occupied = (board->occupied ^ (1ull << begin)) | (1ull << end);
+    uint64_t them = board->b[!colour][OCCUPIED] & ~(1ull << end);
+    int king = bsf(board->b[colour][KING]);
+
+    if(MOVE_TYPE(m) == EP_CAPTURE) {
+        occupied ^= 1ull << ((begin & ~7) | (end & 7));
+        them ^= 1ull << ((begin & ~7) | (end & 7));
+    }
+
+    if(king == begin)
+        king = end;
+
+    return !(attackers(board, king, !colour, occupied) & them);
 }
 
 /* return the set of all squares the given piece is able to move to, without
@@ -357,10 +755,10 @@ uint64_t generate_moves(Game *game, int tile) {
     case PAWN:
         moves = pawn_moves(board, tile);
 
-        int x = tile % 8, y = tile / 8;
-
-        if((game->ep == x + 1 || game->ep == x - 1) && (y == 4 - colour))
-            moves |= 1ull << ((5 - colour * 3) * 8 + game->ep);
+        /* en passant */
+        if(game->ep < 8)
+            moves |= pawn_attacks[colour][tile]
+                & (1ull << ((5 - colour * 3) * 8 + game->ep));
         break;
 
     case KNIGHT:
@@ -390,9 +788,9 @@ uint64_t generate_moves(Game *game, int tile) {
             /* if there are no pieces in the way and no intermediate tiles are
              * threatened, add the move
              */
-            if(!blockers && !is_threatened(board, tile)
-                    && !is_threatened(board, tile - 1)
-                    && !is_threatened(board, tile - 2))
+            if(!blockers && !is_attacked(board, tile, !colour)
+                    && !is_attacked(board, tile - 1, !colour)
+                    && !is_attacked(board, tile - 2, !colour))
                 moves |= 1ull << (tile - 2);
         }
 
@@ -404,9 +802,9 @@ uint64_t generate_moves(Game *game, int tile) {
             /* if there are no pieces in the way and no intermediate tiles are
              * threatened, add the move
              */
-            if(!blockers && !is_threatened(board, tile)
-                    && !is_threatened(board, tile + 1)
-                    && !is_threatened(board, tile + 2))
+            if(!blockers && !is_attacked(board, tile, !colour)
+                    && !is_attacked(board, tile + 1, !colour)
+                    && !is_attacked(board, tile + 2, !colour))
                 moves |= 1ull << (tile + 2);
         }
         break;
@@ -418,17 +816,120 @@ uint64_t generate_moves(Game *game, int tile) {
     return moves & ~board->b[colour][OCCUPIED];
 }
 
+/* return the tile of the given colour's least valuable piece in the given set,
+ * or 64 if there is none.
+ */
+static int least_valuable(Board *board, uint64_t set, int colour) {
+    int piece;
+
+    for(piece = PAWN; piece <= KING; piece++) {
+        if(set & board->b[colour][piece])
+            return bsf(set & board->b[colour][piece]);
+    }
+
+    return 64;
+}
+
+/* return the static exchange evaluation of the given move: the material the
+ * player to move can expect to win if both players keep recapturing on the
+ * end tile with their least valuable piece for as long as it pays, including
+ * pieces revealed behind sliders.
+ */
+int see(Game *game, Move m) {
+    Board *board = &(game->board);
+    int gain[32];
+    int d = 0;
+    int colour = game->turn;
+    int begin = MOVE_BEGIN(m);
+    int end = MOVE_END(m);
+    int piece = board->mailbox[begin];
+    uint64_t occupied = board->occupied;
+    uint64_t attacks, straight, diagonal;
+    int tile;
+
+    /* the first capture, which may be en passant or a promotion */
+    if(MOVE_TYPE(m) == EP_CAPTURE) {
+        gain[0] = piece_score[PAWN];
+        occupied ^= 1ull << ((begin & ~7) | (end & 7));
+    }
+    else if(IS_CAPTURE(m))
+        gain[0] = piece_score[board->mailbox[end]];
+    else
+        gain[0] = 0;
+
+    if(IS_PROMOTION(m)) {
+        piece = PROMOTE_PIECE(m);
+        gain[0] += piece_score[piece] - piece_score[PAWN];
+    }
+
+    occupied ^= 1ull << begin;
+
+    straight = board->b[WHITE][ROOK] | board->b[WHITE][QUEEN]
+        | board->b[BLACK][ROOK] | board->b[BLACK][QUEEN];
+    diagonal = board->b[WHITE][BISHOP] | board->b[WHITE][QUEEN]
+        | board->b[BLACK][BISHOP] | board->b[BLACK][QUEEN];
+    attacks = attackers(board, end, WHITE, occupied)
+        | attackers(board, end, BLACK, occupied);
+
+    while(d < 31) {
+        colour = !colour;
+        attacks &= occupied;
+
+        tile = least_valuable(board, attacks, colour);
+        if(tile == 64)
+            break;
+
+        /* the king can't capture onto a defended tile */
+        if(board->mailbox[tile] == KING
+                && (attacks & board->b[!colour][OCCUPIED]))
+            break;
+
+        /* the score if the piece on the tile is taken and not recaptured;
+         * once even that can't make capturing better than stopping, further
+         * captures can't change the result.
+         */
+        d++;
+        gain[d] = piece_score[piece] - gain[d - 1];
+        if((-gain[d - 1] > gain[d] ? -gain[d - 1] : gain[d]) < 0) {
+            d--;
+            break;
+        }
+
+        piece = board->mailbox[tile];
+        occupied ^= 1ull << tile;
+
+        /* sliders behind the piece that just captured now attack the tile */
+        attacks |= (rook_attacks(end, occupied) & straight)
+            | (bishop_attacks(end, occupied) & diagonal);
+    }
+
+    /* each player only captures if it is better than stopping */
+    while(d > 0) {
+        if(gain[d] > -gain[d - 1])
+            gain[d - 1] = -gain[d];
+        d--;
+    }
+
+    return gain[0];
+}
+
 /* return 1 if the move is valid and 0 otherwise, printing an appropriate
  * message if print is non-zero.
  */
 int is_valid_move(Game game, Move m, int print) {
     Board *board = &(game.board);
-    Game game2 = game;
+    Move moves[MAX_MOVES];
+    int nmoves;
+    int i;
+    int begin = MOVE_BEGIN(m);
+    int end = MOVE_END(m);
     uint64_t beginbit, endbit;
-    char *strmove = xboard_move(m);
+    char strmove[6];
 
-    beginbit = 1ull << m.begin;
-    endbit = 1ull << m.end;
+    xboard_move(m, strmove);
+
+    beginbit = 1ull << begin;
+    endbit = 1ull << end;
 
     /* ensure that the piece belongs to the current player */
     if(!(board->b[game.turn][OCCUPIED] & beginbit)) {
@@ -438,7 +939,7 @@ int is_valid_move(Game game, Move m, int print) {
     }
 
     /* ensure that the end tile can be moved to from the begin tile */
-    if(!(generate_moves(&game, m.begin) & endbit)) {
+    if(!(generate_moves(&game, begin) & endbit)) {
         if(print)
             printf("Illegal move (%s): that piece can't move like that.\n",
                     strmove);
@@ -446,8 +947,8 @@ int is_valid_move(Game game, Move m, int print) {
     }
 
     /* ensure that pawns reaching the eighth rank promote */
-    if(!m.promote && ((m.end / 8) == 0 || (m.end / 8) == 7)
-            && board->mailbox[m.begin] == PAWN) {
+    if(!IS_PROMOTION(m) && (endbit & (RANK_1 | RANK_8))
+            && board->mailbox[begin] == PAWN) {
         if(print)
             printf("Illegal move (%s): pawns reaching the eighth rank must "
                     "promote.\n", strmove);
@@ -455,20 +956,23 @@ int is_valid_move(Game game, Move m, int print) {
     }
 
     /* ensure that no other pieces promote */
-    if(m.promote && (board->mailbox[m.begin] != PAWN
-                || ((m.end / 8) != 0 && (m.end / 8) != 7))) {
+    if(IS_PROMOTION(m) && (board->mailbox[begin] != PAWN
+                || !(endbit & (RANK_1 | RANK_8)))) {
         if(print)
             printf("Illegal move (%s): that piece may not promote at this "
                     "time.\n", strmove);
         return 0;
     }
 
-    /* ensure that the king is not left in check
-     * NOTE: we apply_move() here, so the state of the game is changed; this
-     * check must be done last
+    /* ensure that the king is not left in check; the only moves the piece
+     * can make that are not in the legal move list are those.
      */
-    apply_move(&game2, m);
-    if(king_in_check(&(game2.board), game.turn)) {
+    generate_movelist(&game, moves, &nmoves);
+    for(i = 0; i < nmoves; i++) {
+        if(moves[i] == m)
+            break;
+    }
+    if(i == nmoves) {
         if(print)
             printf("Illegal move (%s): king is left in check.\n", strmove);
         return 0;
@@ -0,0 +1,81 @@
+/* move generation testing for zoe
+ *
+ * James Stanley 2011
+ */
+
+#include "zoe.h"
+#include <time.h>
+
+/* return the number of leaf nodes at the given depth below the given game */
+uint64_t perft(Game *game, int depth) {
+    Move moves[MAX_MOVES];
+    int nmoves;
+    int move;
+    Undo undo;
+    uint64_t nodes = 0;
+
+    if(depth == 0)
+        return 1;
+
+    generate_movelist(game, moves, &nmoves);
+
+    /* bulk count at the last ply, where each legal move is one leaf */
+    if(depth == 1)
+        return nmoves;
+
+    for(move = 0; move < nmoves; move++) {
+        apply_move(game, moves[move], &undo);
+        nodes += perft(game, depth - 1);
+        unmake_move(game, moves[move], &undo);
+    }
+
+    return nodes;
+}
+
+/* return the number of seconds elapsed since some fixed point */
+static double wall_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* run perft to the given depth from the given game, printing the node count
+ * below each root move if divide is non-zero; return the total node count.
+ */
+uint64_t run_perft(Game *game, int depth, int divide) {
+    Move moves[MAX_MOVES];
+    int nmoves;
+    int move;
+    Undo undo;
+    char strmove[6];
+    uint64_t nodes = 0, n;
+    double start = wall_time(), elapsed;
+
+    if(depth < 1)
+        depth = 1;
+
+    generate_movelist(game, moves, &nmoves);
+
+    for(move = 0; move < nmoves; move++) {
+        apply_move(game, moves[move], &undo);
+
+        n = perft(game, depth - 1);
+        nodes += n;
+
+        unmake_move(game, moves[move], &undo);
+
+        if(divide)
+            printf("%s: %llu\n", xboard_move(moves[move], strmove),
+                    (unsigned long long)n);
+    }
+
+    elapsed = wall_time() - start;
+
+    printf("perft %d: %llu nodes in %.3f s (%.0f n/s)\n", depth,
+            (unsigned long long)nodes, elapsed,
+            elapsed > 0 ? nodes / elapsed : 0.0);
+
+    return nodes;
+}
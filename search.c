@@ -6,142 +6,733 @@
 #include "zoe.h"
 #include <time.h>
 
-#define SEARCHDEPTH 6
+/* the clock is checked each time this many more nodes have been searched */
+#define CLOCK_NODES 1024
 
-static int nodes;
+/* milliseconds kept back from the clock for communication with xboard */
+#define TIME_MARGIN 50
 
-/* sort the list of moves to put the ones most likely to be good first */
-static void sort_moves(Move *moves, int nmoves, Game *game) {
-    int firstcap = 0;
-    int firstnot = 0;
-    Move tmp;
+/* moves assumed to be left in the game when there is no time control */
+#define MOVES_TO_GO 30
 
-    while(1) {
-        /* look for the next non-capture move */
-        while((game->board.occupied & (1ull << moves[firstnot].end))
-                    && firstnot < nmoves)
-                firstnot++;
+/* captures that can't bring the score within this much of alpha, even after
+ * taking the piece for free, are not searched in quiescence.
+ */
+#define DELTA_MARGIN 200
 
-        if(firstnot >= nmoves)
-            break;
+/* the stages of a MovePicker */
+#define STAGE_HASH         0
+#define STAGE_GEN_CAPTURES 1
+#define STAGE_CAPTURES     2
+#define STAGE_KILLERS      3
+#define STAGE_GEN_QUIETS   4
+#define STAGE_QUIETS       5
+#define STAGE_DONE         6
+
+/* nodes at least this deep with no hash move search shallower first to find
+ * one.
+ */
+#define IID_DEPTH 4
 
-        /* look for the next capture move */
-        while(!(game->board.occupied & (1ull << moves[firstcap].end))
-                && firstcap < nmoves)
-            firstcap++;
+/* iterations at least this deep search a window this wide either side of
+ * the last iteration's score, and widen it if the score falls outside.
+ */
+#define ASPIRATION_DEPTH  4
+#define ASPIRATION_WINDOW 25
 
-        if(firstcap >= nmoves)
-            break;
+int search_threads = 1;
+
+/* set to show thinking output in the form xboard understands */
+int post = 0;
+
+/* set to show the score and line of every root move */
+int show_root_moves = 0;
+
+/* set to print the statistics of each search as a line of JSON */
+int json_stats = 0;
+
+/* set to search without printing anything, for benchmarking */
+static int silent;
+
+SearchOptions search_options = {1, 2, 1, 3, 4};
+
+/* 40 moves in 5 minutes, as xboard starts with */
+TimeControl time_control = {40, 300000, 0, 0, MAX_DEPTH, 300000, 300000, 0};
+
+/* set to make all search threads return as soon as possible */
+static volatile int stop_search;
+static SearchThread threads[MAX_THREADS];
+
+/* when the current search started, and the times at which it should not
+ * start another iteration and at which it must stop, in milliseconds.
+ */
+static int64_t start_time, soft_time, hard_time;
+
+/* set once the main thread has completed an iteration, so that there is
+ * always a move to play when the search is stopped for time.
+ */
+static int have_move;
+
+/* set while pondering or analysing, when there is no time limit */
+static volatile int infinite;
+
+/* the search running in the background while the main thread reads
+ * commands, when pondering or analysing
+ */
+static pthread_t background_thread;
+static Game background_game;
+static MoveScore background_best;
+
+/* when the search started, for the thinking output */
+static int64_t search_start;
 
-        /* swap the capture with the non-capture */
-        tmp = moves[firstcap];
-        moves[firstcap] = moves[firstnot];
-        moves[firstnot] = tmp;
+/* the depth, score and moves of the last pv shown, so that a new best root
+ * move found late in an iteration isn't shown again when the iteration ends
+ */
+static int printed_depth, printed_score;
+static char printed_moves[128];
+
+/* the main thread's progress through the root moves, for "." in analysis */
+static volatile int root_depth, root_move, root_moves;
+
+/* the result of the last search, whose pv gives the reply to ponder on */
+static MoveScore last_best;
+
+/* the counts for the last search over all threads, the main thread's own
+ * counts at the end of each of its iterations, and how long it took in
+ * milliseconds; the helpers don't search the same iterations, so only the
+ * main thread's counts say how much each iteration cost.
+ */
+static SearchStats last_stats;
+static SearchStats iteration_stats[MAX_DEPTH];
+static int iteration_depth[MAX_DEPTH];
+static int iterations;
+static int64_t last_time;
+
+/* return the time in milliseconds from some fixed point */
+int64_t now_ms(void) {
+    struct timespec ts;
 
-        firstnot++;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* work out how long to spend on this move from the time control */
+static void allocate_time(void) {
+    TimeControl *tc = &time_control;
+    int64_t left = tc->time;
+    int64_t soft, hard;
+    int movestogo;
+
+    if(tc->fixed) {
+        /* st: the time is for this move alone */
+        soft = hard = tc->fixed - TIME_MARGIN;
     }
+    else {
+        /* share the time left between the moves until the time control,
+         * and use most of the increment we'll get back for this one
+         */
+        if(tc->moves_per_session)
+            movestogo = tc->moves_per_session
+                - tc->moves % tc->moves_per_session;
+        else
+            movestogo = MOVES_TO_GO;
+
+        soft = left / movestogo + tc->increment * 3 / 4;
+
+        /* in a hard position the search can run over, but never so far
+         * that it can't make the remaining moves in time
+         */
+        hard = soft * 4;
+        if(hard > left / 3)
+            hard = left / 3;
+        if(soft > hard)
+            soft = hard;
+        hard -= TIME_MARGIN;
+    }
+
+    if(hard < 10)
+        hard = 10;
+    if(soft > hard)
+        soft = hard;
+
+    soft_time = start_time + soft;
+    hard_time = start_time + hard;
 }
 
-/* return the best move from the current position along with it's score */
-MoveScore alphabeta(Game game, int alpha, int beta, int depth) {
-    Move moves[121];/* 121 moves is enough for anybody */
+/* stop the search if the main thread has used up its time */
+static void check_time(SearchThread *t) {
+    if(t->id == 0 && have_move && !infinite && now_ms() >= hard_time)
+        stop_search = 1;
+}
+
+/* add up the counts from all of the threads so far */
+static SearchStats total_stats(void) {
+    SearchStats total;
+    SearchStats *s;
+    int i;
+
+    memset(&total, 0, sizeof(total));
+
+    for(i = 0; i < search_threads; i++) {
+        s = &(threads[i].stats);
+        total.nodes += s->nodes;
+        total.qnodes += s->qnodes;
+        total.tt_probes += s->tt_probes;
+        total.tt_hits += s->tt_hits;
+        total.tt_cutoffs += s->tt_cutoffs;
+        total.tt_overwrites += s->tt_overwrites;
+        total.cutoffs += s->cutoffs;
+        total.first_cutoffs += s->first_cutoffs;
+    }
+
+    return total;
+}
+
+/* return the number of nodes searched by all of the threads so far */
+static uint64_t total_nodes(void) {
+    SearchStats total = total_stats();
+
+    return total.nodes + total.qnodes;
+}
+
+/* return the score as xboard shows it, where mate in n moves is 100000 + n */
+static int xboard_score(int score) {
+    if(score >= INFINITY - MAX_PLY)
+        return 100000 + (INFINITY - score + 1) / 2;
+    if(score <= -INFINITY + MAX_PLY)
+        return -100000 - (INFINITY + score) / 2;
+    return score;
+}
+
+/* show the principal variation: as xboard thinking output, "ply score time
+ * nodes pv" with the time in centiseconds, in post mode, and as a comment
+ * otherwise.
+ */
+static void print_pv(int depth, MoveScore *best) {
+    char line[256], moves[128], strmove[6];
+    int n, i;
+
+    if(silent)
+        return;
+
+    n = 0;
+    for(i = 0; i < 16 && best->pv[i] != NOMOVE; i++)
+        n += sprintf(moves + n, "%s ", xboard_move(best->pv[i], strmove));
+    moves[n] = '\0';
+
+    /* nothing has changed since the last line */
+    if(depth == printed_depth && best->score == printed_score
+            && strcmp(moves, printed_moves) == 0)
+        return;
+
+    printed_depth = depth;
+    printed_score = best->score;
+    strcpy(printed_moves, moves);
+
+    /* the line is written all at once, as the main thread may be printing
+     * while a background search runs.
+     */
+    if(post)
+        sprintf(line, "%d %d %d %llu %s\n", depth, xboard_score(best->score),
+                (int)(now_ms() - search_start) / 10,
+                (unsigned long long)total_nodes(), moves);
+    else
+        sprintf(line, "# pv: %s%d\n", moves, best->score);
+
+    fputs(line, stdout);
+}
+
+/* show the line of play from the given root move and its score, marking the
+ * score as an upper bound if bound is non-zero; like print_pv(), the line is
+ * written all at once, as the main thread may be printing during analysis.
+ */
+static void print_root_move(Move m, MoveScore *new, int bound) {
+    char line[256], strmove[6];
+    int n, i;
+
+    n = sprintf(line, "# %s: ", xboard_move(m, strmove));
+    for(i = 0; i < 16 && new->pv[i] != NOMOVE; i++)
+        n += sprintf(line + n, "%s ", xboard_move(new->pv[i], strmove));
+    sprintf(line + n, "%s%d\n", bound ? "<= " : "", new->score);
+
+    fputs(line, stdout);
+}
+
+/* return 1 if the given move is a capture or promotion and 0 otherwise */
+static int is_tactical(Move m) {
+    return (MOVE_TYPE(m) & (CAPTURE | PROMOTION)) != 0;
+}
+
+/* return 1 if the given move could be played in the given position by the
+ * player to move; it may still leave the king in check.
+ */
+static int playable_move(Game *game, Move m) {
+    Board *board = &(game->board);
+
+    int begin = MOVE_BEGIN(m);
+    int end = MOVE_END(m);
+
+    return (board->b[game->turn][OCCUPIED] & (1ull << begin))
+        && (generate_moves(game, begin) & (1ull << end))
+        && (IS_PROMOTION(m) != 0) == (board->mailbox[begin] == PAWN
+                && ((1ull << end) & (RANK_1 | RANK_8)))
+        && m == make_move(game, begin, end, PROMOTE_PIECE(m));
+}
+
+/* return the most-valuable-victim, least-valuable-attacker score of the given
+ * capture or promotion.
+ */
+static int mvv_lva(Game *game, Move m) {
+    int victim = game->board.mailbox[MOVE_END(m)];
+
+    /* en passant takes a pawn; a promotion gains its piece */
+    if(victim == EMPTY)
+        victim = PAWN;
+
+    return (piece_score[victim]
+            + (IS_PROMOTION(m) ? piece_score[PROMOTE_PIECE(m)] : 0)) * 8
+        - game->board.mailbox[MOVE_BEGIN(m)];
+}
+
+/* swap the best-scored of the moves from the given one onwards into its place
+ * and return it; picking one at a time means the moves after a cut-off are
+ * never sorted.
+ */
+static Move pick_move(Move *moves, int *score, int nmoves, int move) {
+    int best = move;
+    int i;
+    Move m;
+
+    for(i = move + 1; i < nmoves; i++) {
+        if(score[i] > score[best])
+            best = i;
+    }
+
+    m = moves[best];
+    moves[best] = moves[move];
+    moves[move] = m;
+
+    i = score[best];
+    score[best] = score[move];
+    score[move] = i;
+
+    return m;
+}
+
+/* set up the given picker for the current node of the given thread, with
+ * the given move from the hash table to try first.
+ */
+static void init_picker(MovePicker *p, SearchThread *t, Move hashmove) {
+    p->stage = STAGE_HASH;
+    p->hashmove = hashmove;
+    p->killer[0] = t->killer[t->ply][0];
+    p->killer[1] = t->killer[t->ply][1];
+}
+
+/* return the next move from the given picker, or NOMOVE once there are
+ * none left; the hash move and killers are checked to be legal here, as
+ * they come from other positions.
+ */
+static Move next_move(MovePicker *p, SearchThread *t, Game *game) {
+    Move m;
+    int i;
+
+    switch(p->stage) {
+    case STAGE_HASH:
+        p->stage = STAGE_GEN_CAPTURES;
+        if(p->hashmove != NOMOVE && is_legal_move(game, p->hashmove))
+            return p->hashmove;
+        /* fall through */
+
+    case STAGE_GEN_CAPTURES:
+        generate_captures(game, p->moves, &(p->nmoves));
+        for(i = 0; i < p->nmoves; i++)
+            p->score[i] = mvv_lva(game, p->moves[i]);
+        p->next = 0;
+        p->stage = STAGE_CAPTURES;
+        /* fall through */
+
+    case STAGE_CAPTURES:
+        while(p->next < p->nmoves) {
+            m = pick_move(p->moves, p->score, p->nmoves, p->next++);
+            if(m != p->hashmove)
+                return m;
+        }
+        p->next = 0;
+        p->stage = STAGE_KILLERS;
+        /* fall through */
+
+    case STAGE_KILLERS:
+        while(p->next < 2) {
+            m = p->killer[p->next++];
+            if(m != NOMOVE && m != p->hashmove && playable_move(game, m)
+                    && is_legal_move(game, m))
+                return m;
+        }
+        p->stage = STAGE_GEN_QUIETS;
+        /* fall through */
+
+    case STAGE_GEN_QUIETS:
+        generate_quiets(game, p->moves, &(p->nmoves));
+        for(i = 0; i < p->nmoves; i++)
+            p->score[i] = t->history[game->turn][MOVE_BEGIN(p->moves[i])]
+                [MOVE_END(p->moves[i])];
+        p->next = 0;
+        p->stage = STAGE_QUIETS;
+        /* fall through */
+
+    case STAGE_QUIETS:
+        while(p->next < p->nmoves) {
+            m = pick_move(p->moves, p->score, p->nmoves, p->next++);
+            if(m != p->hashmove && m != p->killer[0] && m != p->killer[1])
+                return m;
+        }
+        p->stage = STAGE_DONE;
+    }
+
+    return NOMOVE;
+}
+
+/* halve every history score, keeping their order */
+static void halve_history(SearchThread *t) {
+    int c, i, j;
+
+    for(c = 0; c < 2; c++)
+        for(i = 0; i < 64; i++)
+            for(j = 0; j < 64; j++)
+                t->history[c][i][j] /= 2;
+}
+
+/* forget the killer moves and age the history scores ready for a new search */
+static void clear_history(SearchThread *t) {
+    memset(t->killer, 0, sizeof(t->killer));
+    halve_history(t);
+}
+
+/* remember the given quiet move as having caused a beta cut-off at the given
+ * depth.
+ */
+static void update_cutoff(SearchThread *t, Game *game, Move m, int depth) {
+    Move *killer = t->killer[t->ply];
+    int *history = &(t->history[game->turn][MOVE_BEGIN(m)][MOVE_END(m)]);
+
+    if(m != killer[0]) {
+        killer[1] = killer[0];
+        killer[0] = m;
+    }
+
+    /* deeper cut-offs are worth more; halving the whole table keeps the
+     * scores from overflowing without changing their order.
+     */
+    *history += depth * depth;
+    if(*history >= HISTORY_MAX)
+        halve_history(t);
+}
+
+/* return the score of the current position after searching only captures
+ * and promotions, so that leaf nodes aren't evaluated in the middle of an
+ * exchange; qdepth counts down from 0.
+ */
+static int quiesce(SearchThread *t, Game *game, int alpha, int beta,
+        int qdepth) {
+    Move moves[MAX_MOVES];
     int nmoves;
     int move;
+    int score[MAX_MOVES];
+    int in_check;
+    int stand_pat = game->eval;
+    int n = 0;
+    int new;
+    int victim;
     Move m;
+    Undo undo;
+
+    t->stats.qnodes++;
+
+    if(stop_search)
+        return 0;
+
+    /* when not in check, the player to move can choose not to capture, so
+     * the evaluation is a lower bound on the score and only captures and
+     * promotions need generating; stalemate goes unnoticed here. in check,
+     * every evasion is searched, and having none is checkmate.
+     */
+    in_check = king_in_check(&(game->board), game->turn);
+    if(!in_check) {
+        if(stand_pat >= beta)
+            return beta;
+        if(stand_pat > alpha)
+            alpha = stand_pat;
+
+        generate_captures(game, moves, &nmoves);
+    }
+    else {
+        generate_movelist(game, moves, &nmoves);
+        if(nmoves == 0)
+            return -INFINITY + t->ply - qdepth;
+    }
+
+    /* keep the captures and promotions (or every evasion, in check), scored
+     * with the most valuable victim and least valuable attacker first.
+     */
+    for(move = 0; move < nmoves; move++) {
+        m = moves[move];
+
+        if(IS_CAPTURE(m) && MOVE_TYPE(m) != EP_CAPTURE && !in_check) {
+            victim = game->board.mailbox[MOVE_END(m)];
+
+            /* delta pruning: skip captures that can't raise alpha */
+            if(!IS_PROMOTION(m)
+                    && stand_pat + DELTA_MARGIN + piece_score[victim] <= alpha)
+                continue;
+
+            /* and captures that lose material once the exchange is over;
+             * taking a piece worth at least the capturer never does.
+             */
+            if(piece_score[victim]
+                    < piece_score[game->board.mailbox[MOVE_BEGIN(m)]]
+                    && see(game, m) < 0)
+                continue;
+        }
+
+        if(is_tactical(m))
+            score[n] = mvv_lva(game, m);
+        else if(in_check)
+            score[n] = 0;
+        else
+            continue;
+
+        moves[n++] = m;
+    }
+
+    for(move = 0; move < n; move++) {
+        m = pick_move(moves, score, n, move);
+
+        apply_move(game, m, &undo);
+        new = -quiesce(t, game, -beta, -alpha, qdepth - 1);
+        unmake_move(game, m, &undo);
+
+        if(stop_search)
+            return 0;
+
+        if(new >= beta)
+            return beta;
+        if(new > alpha)
+            alpha = new;
+    }
+
+    return alpha;
+}
+
+/* return the best move from the current position along with it's score */
+MoveScore alphabeta(SearchThread *t, Game *game, int alpha, int beta,
+        int depth) {
+    Move moves[MAX_MOVES];
+    MovePicker picker;
+    int nmoves;
+    int move;
+    Move m, hashmove;
     MoveScore best, new;
-    Game orig_game;
-    int legal_move = 0;
+    Undo undo;
+    int in_check;
     int hashtype = ATMOST;
+    int quiet, reduction;
     int i;
 
-    nodes++;
+    t->stats.nodes++;
 
-    /* store a copy of the game */
-    orig_game = game;
+    /* look at the clock every so often, without a system call every node */
+    if(t->stats.nodes % CLOCK_NODES == 0)
+        check_time(t);
 
-    /* try to retrieve the score from the transposition table */
-    new = hash_retrieve(orig_game.board.zobrist, depth, alpha, beta,
-            orig_game.turn);
-    if(new.move.begin != 64) {
-        /* TODO: ensure that the move is valid (i.e. that this zobrist key is
-         * not just a coincidence).
-         */
+    /* give up if the search has been stopped; the result is not used */
+    if(stop_search) {
+        best.move = NOMOVE;
+        best.score = 0;
+        return best;
+    }
+
+    /* a repeated position or one drawn by the fifty move rule is a draw
+     * whatever the hash table says; the root still needs a move.
+     */
+    if(t->ply > 0 && is_draw(game)) {
+        best.move = NOMOVE;
+        best.score = 0;
+        best.pv[0] = NOMOVE;
+        return best;
+    }
+
+    /* try to retrieve the score from the transposition table, and the best
+     * move found last time this position was searched. a move that can't be
+     * played here means the key matched a different position. the root is
+     * always searched, so that each iteration has a full pv to show.
+     */
+    new = hash_retrieve(game->board.zobrist, depth, alpha, beta, t->ply,
+            &hashmove);
+    t->stats.tt_probes++;
+    if(hashmove != NOMOVE && !playable_move(game, hashmove)) {
+        hashmove = NOMOVE;
+        new.move = NOMOVE;
+    }
+    if(hashmove != NOMOVE)
+        t->stats.tt_hits++;
+    if(new.move != NOMOVE && t->ply > 0) {
+        t->stats.tt_cutoffs++;
         return new;
     }
 
     /* store lower bound on best score */
-    if(depth < SEARCHDEPTH - 1)
-        best.score = alpha;
-    else
-        best.score = -INFINITY;
+    best.score = alpha;
+    best.pv[0] = NOMOVE;
 
-    /* if at a leaf node, return position evaluation */
+    /* if at a leaf node, return the quiescent position evaluation; it has
+     * no move, so there is no use storing it in the hash table.
+     */
     if(depth == 0) {
-        best.move.begin = 64;
-        best.score = game.eval;
-        best.pv[0].begin = 64;
-        hash_store(orig_game.board.zobrist, depth, EXACTLY, best,
-                orig_game.turn);
+        best.move = NOMOVE;
+        best.score = quiesce(t, game, alpha, beta, 0);
+        best.pv[0] = NOMOVE;
         return best;
     }
 
-    /* get a list of valid moves */
-    generate_movelist(&game, moves, &nmoves);
+    /* null move pruning: if we are still at least beta after passing the
+     * turn, a real move would almost certainly be too, so there is no need
+     * to search further. that doesn't hold in zugzwang, which is most
+     * likely with only pawns left, and a player in check can't pass.
+     */
+    if(search_options.null_move && t->ply > 0 && !t->null_move[t->ply]
+            && beta - alpha == 1 && depth > search_options.null_reduction
+            && game->eval >= beta && beta < INFINITY - MAX_PLY
+            && (game->board.b[game->turn][OCCUPIED]
+                ^ game->board.b[game->turn][PAWN]
+                ^ game->board.b[game->turn][KING])
+            && !king_in_check(&(game->board), game->turn)) {
+        apply_null_move(game, &undo);
+        t->ply++;
+        t->null_move[t->ply] = 1;
 
-    /* sort the moves */
-    sort_moves(moves, nmoves, &game);
+        new = alphabeta(t, game, -beta, -beta + 1,
+                depth - 1 - search_options.null_reduction);
+        new.score = -new.score;
 
-    /* for each of the moves */
-    for(move = 0; move < nmoves; move++) {
-        m = moves[move];
+        t->null_move[t->ply] = 0;
+        t->ply--;
+        unmake_null_move(game, &undo);
 
-        /* reset the game state */
-        game = orig_game;
+        if(stop_search)
+            return new;
 
-        /* make the move */
-        apply_move(&game, m);
+        if(new.score >= beta) {
+            best.move = NOMOVE;
+            best.score = beta;
+            return best;
+        }
+    }
 
-        /* don't search this move if the king is left in check */
-        if(king_in_check(&(game.board), !game.turn)) {
-            if(depth == SEARCHDEPTH)
-                printf("%s leaves the king in check\n", xboard_move(m));
+    in_check = king_in_check(&(game->board), game->turn);
 
-            continue;
-        }
+    /* the analysis status counts the root moves, which are otherwise only
+     * generated as they are needed.
+     */
+    if(t->ply == 0 && t->id == 0) {
+        generate_movelist(game, moves, &nmoves);
+        root_moves = nmoves;
+        root_depth = depth;
+    }
 
-        /* if this is the first legal move, store it as the best so that
-         * we at least have a move to play, and remember that we have found
-         * a legal move.
+    /* with no hash move, a shallower search finds a good first move */
+    if(hashmove == NOMOVE && depth >= IID_DEPTH) {
+        new = alphabeta(t, game, alpha, beta, depth - 2);
+        if(stop_search)
+            return new;
+        hashmove = new.move;
+    }
+
+    /* try the moves most likely to be good first */
+    init_picker(&picker, t, hashmove);
+
+    /* for each of the moves */
+    for(move = 0; (m = next_move(&picker, t, game)) != NOMOVE; move++) {
+        if(t->ply == 0 && t->id == 0)
+            root_move = move;
+
+        /* if this is the first move, store it as the best so that we at
+         * least have a move to play.
          */
-        if(!legal_move) {
+        if(move == 0)
             best.move = m;
-            legal_move = 1;
-        }
 
-        /* search the next level; we need to do a full search from the top
-         * level in order to get the pv for each move.
+        quiet = !is_tactical(m);
+
+        /* make the move */
+        apply_move(game, m, &undo);
+        t->ply++;
+
+        /* search the next level. the first move is expected to be the
+         * best, so the others only need to be shown to be no better with a
+         * null window, and are searched again if they turn out better.
          */
-        if(depth == SEARCHDEPTH)
-            new = alphabeta(game, -INFINITY, INFINITY, depth - 1);
-        else
-            new = alphabeta(game, -beta, -best.score, depth - 1);
-        new.score = -new.score;
+        if(move == 0) {
+            new = alphabeta(t, game, -beta, -best.score, depth - 1);
+            new.score = -new.score;
+        }
+        else {
+            /* late move reductions: a quiet move ordered this late is
+             * unlikely to be any good, so it is searched less deeply
+             * unless that shows it beats alpha after all.
+             */
+            reduction = 0;
+            if(search_options.lmr && quiet && !in_check
+                    && depth >= search_options.lmr_depth
+                    && move >= search_options.lmr_moves
+                    && picker.stage == STAGE_QUIETS
+                    && !king_in_check(&(game->board), game->turn))
+                reduction = 1;
+
+            new = alphabeta(t, game, -best.score - 1, -best.score,
+                    depth - 1 - reduction);
+            new.score = -new.score;
+
+            if(reduction && new.score > best.score && !stop_search) {
+                new = alphabeta(t, game, -best.score - 1, -best.score,
+                        depth - 1);
+                new.score = -new.score;
+            }
 
-        /* show the expected line of play from this move at top level */
-        if(depth == SEARCHDEPTH) {
-            printf("%s: ", xboard_move(m));
-            for(i = 0; i < 16 && new.pv[i].begin < 64; i++) {
-                printf("%s ", xboard_move(new.pv[i]));
+            if(new.score > best.score && new.score < beta && !stop_search) {
+                new = alphabeta(t, game, -beta, -best.score, depth - 1);
+                new.score = -new.score;
             }
-            printf("%d\n", new.score);
         }
 
-        /* beta cut-off */
+        /* take the move back */
+        t->ply--;
+        unmake_move(game, m, &undo);
+
+        /* don't let a stopped search's result into the hash table */
+        if(stop_search)
+            return new;
+
+        /* show the expected line of play from this move at top level; a
+         * score no better than the best so far is only an upper bound.
+         */
+        if(show_root_moves && !silent && t->ply == 0 && t->id == 0)
+            print_root_move(m, &new, new.score <= best.score);
+
+        /* beta cut-off; remember quiet moves that cause them */
         if(new.score >= beta) {
+            if(quiet)
+                update_cutoff(t, game, m, depth);
+
+            t->stats.cutoffs++;
+            if(move == 0)
+                t->stats.first_cutoffs++;
+
             best.move = m;
             best.score = beta;
-            hash_store(orig_game.board.zobrist, depth, ATLEAST, best,
-                    orig_game.turn);
+            t->stats.tt_overwrites += hash_store(game->board.zobrist, depth,
+                    ATLEAST, best, t->ply);
             return best;
         }
 
@@ -161,88 +752,304 @@ MoveScore alphabeta(Game game, int alpha, int beta, int depth) {
                 best.pv[i+1] = new.pv[i];
             }
             best.pv[0] = m;
+
+            /* a new best move at the root changes the pv */
+            if(t->ply == 0 && t->id == 0 && move > 0 && post)
+                print_pv(depth, &best);
         }
     }
 
-    /* reset to original game */
-    game = orig_game;
-
     /* no legal moves? checkmate or stalemate */
-    if(!legal_move) {
-        /* adding (depth - SEARCHDEPTH) ensures that we drag out a forced
-         * loss for as long as possible, and also that we force a win as
-         * quickly as possible.
+    if(move == 0) {
+        /* adding the ply ensures that we drag out a forced loss for as
+         * long as possible, and also that we force a win as quickly as
+         * possible.
          */
-        if(king_in_check(&(game.board), game.turn))
-            best.score = -INFINITY + (depth - SEARCHDEPTH);
+        if(in_check)
+            best.score = -INFINITY + t->ply;
         else
             best.score = 0;
 
-        best.move.begin = 64;
+        best.move = NOMOVE;
     }
     else {
         /* we found a legal move and more searching was done, so we have a
          * lower bound on the score.
          */
-        hash_store(orig_game.board.zobrist, depth, hashtype, best,
-                orig_game.turn);
+        t->stats.tt_overwrites += hash_store(game->board.zobrist, depth,
+                hashtype, best, t->ply);
     }
 
-    /* TODO: deal with post mode */
+    return best;
+}
 
-    /* show the pv */
-    if(depth == SEARCHDEPTH) {
-        printf("# pv: ");
-        for(i = 0; i < 16 && best.pv[i].begin < 64; i++) {
-            printf("%s ", xboard_move(best.pv[i]));
-        }
-        printf("%d\n", best.score);
-    }
+/* set the number of threads to search with */
+void set_threads(int n) {
+    if(n < 1)
+        n = 1;
+    if(n > MAX_THREADS)
+        n = MAX_THREADS;
 
-    return best;
+    search_threads = n;
 }
 
 /* return the best move from the current position along with it's score */
-MoveScore iterative_deepening(Game game) {
+MoveScore iterative_deepening(SearchThread *t) {
+    Move moves[MAX_MOVES];
+    int nmoves;
     int d;
-    MoveScore best;
+    int alpha, beta, window;
+    MoveScore best, new;
+
+    best.move = NOMOVE;
+    best.score = 0;
+
+    generate_movelist(&(t->game), moves, &nmoves);
 
-    /* iteratively deepen until the maximum depth is reached */
-    for(d = 1; d <= SEARCHDEPTH; d++) {
-        best = alphabeta(game, -INFINITY, INFINITY, d);
+    /* iteratively deepen until the maximum depth is reached; half of the
+     * helper threads start a ply deeper so that the threads spread out over
+     * different depths and fill the shared hash table for each other.
+     */
+    for(d = 1 + (t->id & 1); d <= time_control.depth; d++) {
+        /* the score probably hasn't changed much since the last iteration,
+         * and a narrower window searches fewer nodes.
+         */
+        if(d >= ASPIRATION_DEPTH && best.move != NOMOVE) {
+            alpha = best.score - ASPIRATION_WINDOW;
+            beta = best.score + ASPIRATION_WINDOW;
+        }
+        else {
+            alpha = -INFINITY;
+            beta = INFINITY;
+        }
+        window = ASPIRATION_WINDOW;
+
+        for(;;) {
+            new = alphabeta(t, &(t->game), alpha, beta, d);
+
+            if(stop_search)
+                break;
+
+            /* search again with the window widened on the side it failed */
+            if(new.score <= alpha && alpha > -INFINITY)
+                alpha = alpha - window < -INFINITY ? -INFINITY : alpha - window;
+            else if(new.score >= beta && beta < INFINITY)
+                beta = beta + window > INFINITY ? INFINITY : beta + window;
+            else
+                break;
+
+            window *= 4;
+        }
+
+        /* an unfinished iteration is no use; play the last complete one */
+        if(stop_search)
+            break;
+
+        best = new;
+
+        if(t->id == 0 && best.move != NOMOVE) {
+            print_pv(d, &best);
+
+            /* keep the counts at the end of each iteration */
+            if(iterations < MAX_DEPTH) {
+                iteration_stats[iterations] = t->stats;
+                iteration_depth[iterations] = d;
+                iterations++;
+            }
+        }
 
         /* if we have no legal moves, return now */
-        if(best.move.begin == 64)
+        if(best.move == NOMOVE)
             return best;
 
         /* if this is a mate, return now */
-        if(best.score == INFINITY) {
-            printf("# Mate in %d.\n", d/2);
+        if(best.score >= INFINITY - MAX_PLY) {
+            if(t->id == 0 && !silent)
+                printf("# Mate in %d.\n", (INFINITY - best.score + 1) / 2);
             return best;
         }
 
-        /* TODO: stop searching if the entire tree is searched */
+        /* the rest is for the main thread to decide */
+        if(t->id != 0)
+            continue;
 
-        /* TODO: stop searching if time limit reached */
+        /* a forced move needs no thought, unless there's no hurry */
+        if(nmoves == 1 && !infinite)
+            break;
+
+        /* once one iteration is complete there is a move to fall back on,
+         * so the search can be stopped when it runs out of time.
+         */
+        have_move = 1;
+
+        /* while pondering or analysing, only a command stops the search */
+        if(infinite)
+            continue;
+
+        /* don't start an iteration that probably won't finish; each one
+         * takes longer than all of the ones before it.
+         */
+        if(now_ms() - start_time >= (soft_time - start_time) / 2)
+            break;
     }
 
     return best;
 }
 
-/* return the best move for the current player */
-Move best_move(Game game) {
-    clock_t start = clock();
-    nodes = 0;
+/* run a helper thread's search; its result is only left in the hash table */
+static void *helper_thread(void *arg) {
+    iterative_deepening(arg);
+
+    return NULL;
+}
+
+/* return the number of nodes searched per second of wall clock time */
+static double nps(SearchStats *s, int64_t ms) {
+    return (double)(s->nodes + s->qnodes) * 1000 / (ms ? ms : 1);
+}
+
+/* return n as a percentage of total */
+static double percent(uint64_t n, uint64_t total) {
+    return total ? 100.0 * n / total : 0.0;
+}
+
+/* return the nodes searched by the main thread, quiescence included, by the
+ * end of the given iteration
+ */
+static uint64_t searched(int iteration) {
+    return iteration_stats[iteration].nodes + iteration_stats[iteration].qnodes;
+}
+
+/* return the effective branching factor: how many times more nodes the last
+ * iteration searched than the one before it.
+ */
+static double ebf(void) {
+    uint64_t last, prev;
 
-    MoveScore best = iterative_deepening(game);
+    if(iterations < 2)
+        return 0.0;
 
-    printf("# %.2f n/s\n", (float)(nodes * CLOCKS_PER_SEC) / (clock() - start));
+    last = searched(iterations - 1) - searched(iterations - 2);
+    prev = searched(iterations - 2)
+        - (iterations > 2 ? searched(iterations - 3) : 0);
 
-    if(best.move.begin == 64) { /* we had no legal moves */
+    return prev ? (double)last / prev : 0.0;
+}
+
+/* show the statistics of the last search */
+void print_stats(void) {
+    SearchStats *s = &last_stats;
+    uint64_t prev = 0;
+    int i;
+
+    printf("# depth nodes%s\n", search_threads > 1 ? " (main thread)" : "");
+    for(i = 0; i < iterations; i++) {
+        printf("# %5d %llu\n", iteration_depth[i],
+                (unsigned long long)(searched(i) - prev));
+        prev = searched(i);
+    }
+
+    printf("# %llu nodes, %llu in quiescence, in %.2f s (%.0f n/s)\n",
+            (unsigned long long)(s->nodes + s->qnodes),
+            (unsigned long long)s->qnodes, last_time / 1000.0,
+            nps(s, last_time));
+    printf("# effective branching factor %.2f\n", ebf());
+    printf("# hash: %llu probes, %.1f%% hits, %.1f%% cutoffs, "
+            "%llu overwrites\n", (unsigned long long)s->tt_probes,
+            percent(s->tt_hits, s->tt_probes),
+            percent(s->tt_cutoffs, s->tt_probes),
+            (unsigned long long)s->tt_overwrites);
+    printf("# beta cutoffs: %llu, %.1f%% by the first move\n",
+            (unsigned long long)s->cutoffs,
+            percent(s->first_cutoffs, s->cutoffs));
+}
+
+/* show the statistics of the last search as one line of JSON */
+static void print_json_stats(void) {
+    SearchStats *s = &last_stats;
+
+    printf("# stats {\"depth\":%d,\"nodes\":%llu,\"qnodes\":%llu,"
+            "\"time_ms\":%lld,\"nps\":%.0f,\"ebf\":%.2f,"
+            "\"tt_probes\":%llu,\"tt_hits\":%llu,\"tt_cutoffs\":%llu,"
+            "\"tt_overwrites\":%llu,\"cutoffs\":%llu,"
+            "\"first_cutoffs\":%llu}\n",
+            iterations ? iteration_depth[iterations - 1] : 0,
+            (unsigned long long)(s->nodes + s->qnodes),
+            (unsigned long long)s->qnodes, (long long)last_time,
+            nps(s, last_time), ebf(),
+            (unsigned long long)s->tt_probes,
+            (unsigned long long)s->tt_hits,
+            (unsigned long long)s->tt_cutoffs,
+            (unsigned long long)s->tt_overwrites,
+            (unsigned long long)s->cutoffs,
+            (unsigned long long)s->first_cutoffs);
+}
+
+/* search the given position with all of the threads, until the main thread
+ * finishes, and return the main thread's result.
+ */
+static MoveScore search(Game *game) {
+    int i;
+
+    search_start = now_ms();
+    printed_depth = 0;
+    have_move = 0;
+    iterations = 0;
+
+    /* start the helper threads searching the same position */
+    for(i = 0; i < search_threads; i++) {
+        threads[i].id = i;
+        threads[i].game = *game;
+        memset(&(threads[i].stats), 0, sizeof(threads[i].stats));
+        threads[i].ply = 0;
+        memset(threads[i].null_move, 0, sizeof(threads[i].null_move));
+        clear_history(threads + i);
+
+        if(i > 0 && pthread_create(&(threads[i].thread), NULL, helper_thread,
+                    threads + i) != 0) {
+            fprintf(stderr, "can't start helper thread %d\n", i);
+            search_threads = i;
+            break;
+        }
+    }
+
+    /* the main thread's search decides the move */
+    MoveScore best = iterative_deepening(threads);
+
+    /* stop the helpers */
+    stop_search = 1;
+    for(i = 1; i < search_threads; i++)
+        pthread_join(threads[i].thread, NULL);
+    stop_search = 0;
+
+    /* keep the counts for the stats command */
+    last_stats = total_stats();
+    last_time = now_ms() - search_start;
+
+    if(!silent) {
+        printf("# %llu nodes, %llu in quiescence\n",
+                (unsigned long long)(last_stats.nodes + last_stats.qnodes),
+                (unsigned long long)last_stats.qnodes);
+        printf("# %.2f n/s in %.2f s\n", nps(&last_stats, last_time),
+                last_time / 1000.0);
+
+        if(json_stats)
+            print_json_stats();
+    }
+
+    last_best = best;
+    return best;
+}
+
+/* return the move to play from the search result, announcing the end of the
+ * game if there isn't one.
+ */
+static Move result_move(MoveScore best, int turn) {
+    if(best.move == NOMOVE) { /* we had no legal moves */
         if(best.score == 0)
             printf("1/2-1/2 {Stalemate}\n");
         else /* best.score == -INFINITY */ {
-            if(game.turn == WHITE)
+            if(turn == WHITE)
                 printf("0-1 {Black mates}\n");
             else
                 printf("1-0 {White mates}\n");
@@ -250,3 +1057,142 @@ Move best_move(Game game) {
     }
     return best.move;
 }
+
+/* return the best move for the current player */
+Move best_move(Game game) {
+    hash_new_search();
+
+    start_time = now_ms();
+    allocate_time();
+    infinite = 0;
+    stop_search = 0;
+
+    return result_move(search(&game), game.turn);
+}
+
+/* search the given position to the given depth with no time limit and no
+ * output, and return the counts of what the search did.
+ */
+SearchStats bench_search(Game game, int depth) {
+    int maxdepth = time_control.depth;
+
+    hash_new_search();
+
+    time_control.depth = depth;
+    infinite = 1;
+    silent = 1;
+    stop_search = 0;
+
+    search(&game);
+
+    time_control.depth = maxdepth;
+    infinite = 0;
+    silent = 0;
+
+    return last_stats;
+}
+
+/* run the pondering or analysis search */
+static void *background_main(void *arg) {
+    background_best = search(&background_game);
+
+    return NULL;
+}
+
+/* start searching background_game with no time limit; return 1 on success
+ * and 0 otherwise.
+ */
+static int start_background(void) {
+    hash_new_search();
+    infinite = 1;
+    stop_search = 0;
+
+    if(pthread_create(&background_thread, NULL, background_main, NULL) != 0) {
+        fprintf(stderr, "can't start background search thread\n");
+        infinite = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* stop the background search, whose result is not wanted */
+void stop_background(void) {
+    stop_search = 1;
+    pthread_join(background_thread, NULL);
+    infinite = 0;
+    stop_search = 0;
+}
+
+/* start searching, in the background, the position after the reply we
+ * expect to the move we just played; return the expected reply, or NOMOVE
+ * if there is nothing to ponder.
+ */
+Move start_pondering(Game game) {
+    char strmove[6];
+    Move moves[MAX_MOVES];
+    int nmoves;
+    int i;
+    Move m = last_best.pv[1];
+
+    /* without a reply in the pv, the hash table might know one */
+    if(m == NOMOVE)
+        hash_retrieve(game.board.zobrist, 0, -INFINITY, INFINITY, 0, &m);
+
+    /* make sure the reply can be played */
+    generate_movelist(&game, moves, &nmoves);
+    for(i = 0; i < nmoves; i++)
+        if(moves[i] == m)
+            break;
+    if(i == nmoves) {
+        m = NOMOVE;
+        return m;
+    }
+
+    background_game = game;
+    apply_move(&background_game, m, NULL);
+
+    if(!start_background()) {
+        m = NOMOVE;
+        return m;
+    }
+
+    printf("# pondering %s\n", xboard_move(m, strmove));
+    return m;
+}
+
+/* the opponent played the expected reply, so carry on with the search that
+ * is already underway, now with a time limit, and return its move.
+ */
+Move ponder_hit(void) {
+    start_time = now_ms();
+    allocate_time();
+
+    /* the search thread must see the new limits before it sees that it is
+     * no longer pondering
+     */
+    __sync_synchronize();
+    infinite = 0;
+
+    pthread_join(background_thread, NULL);
+
+    return result_move(background_best, background_game.turn);
+}
+
+/* start analysing the given position until stop_background() is called;
+ * return 1 on success and 0 otherwise.
+ */
+int start_analysis(Game game) {
+    background_game = game;
+
+    return start_background();
+}
+
+/* show xboard the progress of the analysis, as "stat01: time nodes ply
+ * mvleft mvtot"
+ */
+void analysis_status(void) {
+    printf("stat01: %d %llu %d %d %d\n", (int)(now_ms() - search_start) / 10,
+            (unsigned long long)total_nodes(), root_depth,
+            root_moves - root_move - 1, root_moves);
+}
@@ -7,7 +7,124 @@
 
 #include "zoe.h"
 
-int post = 0;
+/* the depth searched by "zoe bench" if none is given */
+#define BENCH_DEPTH 8
+
+/* the search options that xboard can set with "option NAME=VALUE"; those
+ * that can only be 0 or 1 are shown as check boxes.
+ */
+static struct {
+    char *name;
+    int *value;
+    int min, max;
+} options[] = {
+    { "Null move", &search_options.null_move, 0, 1 },
+    { "Null move reduction", &search_options.null_reduction, 1, 4 },
+    { "Late move reductions", &search_options.lmr, 0, 1 },
+    { "LMR depth", &search_options.lmr_depth, 2, 16 },
+    { "LMR moves", &search_options.lmr_moves, 1, 64 },
+    { "JSON stats", &json_stats, 0, 1 },
+    { NULL, NULL, 0, 0 }
+};
+
+/* tell xboard about the options it can set */
+void announce_options(void) {
+    int i;
+
+    for(i = 0; options[i].name; i++) {
+        if(options[i].min == 0 && options[i].max == 1)
+            printf("feature option=\"%s -check %d\"\n", options[i].name,
+                    *options[i].value);
+        else
+            printf("feature option=\"%s -spin %d %d %d\"\n",
+                    options[i].name, *options[i].value, options[i].min,
+                    options[i].max);
+    }
+}
+
+/* set an option from "NAME=VALUE"; return 1 on success and 0 if there is
+ * no such option.
+ */
+int set_option(const char *arg) {
+    char *eq = strchr(arg, '=');
+    int value;
+    int i;
+
+    if(!eq)
+        return 0;
+
+    for(i = 0; options[i].name; i++) {
+        if(strlen(options[i].name) == eq - arg
+                && strncmp(options[i].name, arg, eq - arg) == 0) {
+            value = atoi(eq + 1);
+            if(value < options[i].min)
+                value = options[i].min;
+            if(value > options[i].max)
+                value = options[i].max;
+            *options[i].value = value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* return the number of megabytes in the given string, or 0 if it is not a
+ * number from 1 to HT_MAX_MB.
+ */
+static size_t parse_mb(const char *s) {
+    char *end;
+    long mb = strtol(s, &end, 10);
+
+    if(end == s || *end != '\0' || mb < 1 || mb > HT_MAX_MB)
+        return 0;
+
+    return mb;
+}
+
+/* return the number in the given string, or 0 if it is not a number from 1
+ * to max.
+ */
+static int parse_count(const char *s, int max) {
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    if(end == s || *end != '\0' || n < 1 || n > max)
+        return 0;
+
+    return n;
+}
+
+/* show how zoe is run */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--hash MB] [--threads N] [--fen FEN] "
+            "[--option NAME=VALUE] [--root-moves] [--perft N | --divide N]\n"
+            "       %s bench [depth] [hash MB] [threads]\n", prog, prog);
+}
+
+/* set the time control from the arguments of xboard's "level MPS BASE INC"
+ * command; BASE is either minutes or minutes:seconds, and INC is seconds.
+ */
+void set_level(const char *args) {
+    TimeControl *tc = &time_control;
+    int mps, min, sec = 0;
+    double inc;
+
+    if(sscanf(args, "%d %d:%d %lf", &mps, &min, &sec, &inc) != 4) {
+        sec = 0;
+        if(sscanf(args, "%d %d %lf", &mps, &min, &inc) != 3) {
+            printf("Error (bad time control): level %s\n", args);
+            return;
+        }
+    }
+
+    tc->moves_per_session = mps;
+    tc->base = (min * 60 + sec) * 1000;
+    tc->increment = inc * 1000;
+    tc->fixed = 0;
+    tc->time = tc->otime = tc->base;
+    tc->moves = 0;
+}
 
 /* handle the board edit mode */
 void edit_mode(Game *g) {
@@ -17,12 +134,15 @@ void edit_mode(Game *g) {
     int tile;
     uint64_t tilebit;
     int i, j;
-    int piece;
+    int piece, colour;
     int gameturn = g->turn;
 
-    /* TODO: "[upon leaving edit mode] for purposes of the draw by repetition
-     *        rule, no prior positions are deemed to have occurred."
+    /* "[upon leaving edit mode] for purposes of the draw by repetition
+     *  rule, no prior positions are deemed to have occurred."
      */
+    g->nkeys = 0;
+    if(g->ep < 8)
+        g->board.zobrist ^= zobrist_ep[g->ep];
     g->ep = 9;
     g->quiet_moves = 0;
 
@@ -30,11 +150,13 @@ void edit_mode(Game *g) {
         /* make it white's turn so that the evaluation makes sense */
         g->turn = WHITE;
         g->eval = -g->eval;
+        g->board.zobrist ^= zobrist_turn;
     }
 
     printf("turn is %c\n", "WB"[g->turn]);
 
     /* remove castling rights for each player for each side */
+    g->board.zobrist ^= zobrist_castle[castle_rights(g)];
     for(i = 0; i < 2; i++)
         for(j = 0; j < 2; j++)
             g->can_castle[i][j] = 0;
@@ -50,11 +172,14 @@ void edit_mode(Game *g) {
             /* switch colour */
             g->turn = !g->turn;
             g->eval = -g->eval;
+            g->board.zobrist ^= zobrist_turn;
         }
         else if(strcmp(line, "#") == 0) {
-            /* clear the board */
+            /* clear the board; only the colour is left in the key */
             g->eval = 0;
             clear_board(&(g->board));
+            if(g->turn == BLACK)
+                g->board.zobrist ^= zobrist_turn;
         }
         else if(strcmp(line, ".") == 0) {
             /* leave edit mode */
@@ -66,12 +191,20 @@ void edit_mode(Game *g) {
             tile = line[1] - 'a' + ((line[2] - '1') * 8);
             tilebit = 1ull << tile;
 
-            /* remove this piece */
-            g->eval -= piece_square_score(g->board.mailbox[tile], tile,
-                    !!(g->board.b[WHITE][OCCUPIED] & tilebit));
+            /* remove this piece; eval is for the colour being placed */
+            if(g->board.mailbox[tile] != EMPTY) {
+                colour = !(g->board.b[WHITE][OCCUPIED] & tilebit);
 
-            g->board.zobrist ^= zobrist[g->board.mailbox[tile]][tile];
-            g->board.zobrist ^= zobrist[EMPTY][tile];
+                if(colour == g->turn)
+                    g->eval -= piece_square_score(g->board.mailbox[tile], tile,
+                            colour);
+                else
+                    g->eval += piece_square_score(g->board.mailbox[tile], tile,
+                            colour);
+
+                g->board.zobrist ^= zobrist[colour][g->board.mailbox[tile]]
+                    [tile];
+            }
 
             g->board.mailbox[tile] = EMPTY;
             g->board.occupied &= ~tilebit;
@@ -88,8 +221,7 @@ void edit_mode(Game *g) {
 
                     g->eval += piece_square_score(piece, tile, g->turn);
 
-                    g->board.zobrist ^= zobrist[EMPTY][tile];
-                    g->board.zobrist ^= zobrist[piece][tile];
+                    g->board.zobrist ^= zobrist[g->turn][piece][tile];
 
                     g->board.mailbox[tile] = piece;
                     g->board.occupied |= tilebit;
@@ -107,27 +239,47 @@ void edit_mode(Game *g) {
         /* toggle the turn back if necessary */
         g->turn = !g->turn;
         g->eval = -g->eval;
+        g->board.zobrist ^= zobrist_turn;
     }
 
     /* allow castling where appropriate */
-    if(g->board.b[BLACK][KING] & (1ull << 4)) {
-        if(g->board.b[BLACK][ROOK] & (1ull << 7))
+    if(g->board.b[WHITE][KING] & (1ull << 4)) {
+        if(g->board.b[WHITE][ROOK] & (1ull << 7))
+            g->can_castle[WHITE][KINGSIDE] = 1;
+        if(g->board.b[WHITE][ROOK] & (1ull))
+            g->can_castle[WHITE][QUEENSIDE] = 1;
+    }
+    if(g->board.b[BLACK][KING] & (1ull << 60)) {
+        if(g->board.b[BLACK][ROOK] & (1ull << 63))
             g->can_castle[BLACK][KINGSIDE] = 1;
-        if(g->board.b[BLACK][ROOK] & (1ull))
+        if(g->board.b[BLACK][ROOK] & (1ull << 56))
             g->can_castle[BLACK][QUEENSIDE] = 1;
     }
-    if(g->board.b[WHITE][KING] & (1ull << 60)) {
-        if(g->board.b[WHITE][ROOK] & (1ull << 63))
-            g->can_castle[WHITE][KINGSIDE] = 1;
-        if(g->board.b[WHITE][ROOK] & (1ull << 56))
-            g->can_castle[WHITE][QUEENSIDE] = 1;
+    g->board.zobrist ^= zobrist_castle[castle_rights(g)];
+
+#ifdef DEBUG
+    if(g->board.zobrist != compute_zobrist(g)) {
+        printf("!!! Incremental key wrong after edit mode!\n");
+        exit(1);
     }
+#endif
 }
 
 int main(int argc, char **argv) {
-    Game game;
+    Game game, game2;
     char *line = NULL;
     size_t len = 0;
+    char *fen = NULL;
+    int perft_depth = 0, divide = 0;
+    int depth = BENCH_DEPTH, threads = 1;
+    size_t hash_mb = HT_DEFAULT_MB;
+    int ponder = 0, hit = 0;
+    int analyze = 0, analysing = 0;
+    Move pondermove;
+    char strmove[6];
+    int i;
+
+    pondermove = NOMOVE;
 
     /* don't quit when xboard sends SIGINT */
     if(!isatty(STDIN_FILENO))
@@ -146,7 +298,98 @@ int main(int argc, char **argv) {
     /* setup the initial game state */
     reset_game(&game);
 
+    /* search the bench positions and exit without talking to xboard */
+    if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+        if(argc > 2)
+            depth = parse_count(argv[2], MAX_DEPTH);
+        if(argc > 4)
+            threads = parse_count(argv[4], MAX_THREADS);
+        if(argc > 5 || !depth || !threads) {
+            usage(argv[0]);
+            return 1;
+        }
+        if(argc > 3 && !(hash_mb = parse_mb(argv[3]))) {
+            fprintf(stderr, "%s: invalid hash size: %s\n", argv[0], argv[3]);
+            return 1;
+        }
+        set_threads(threads);
+        if(!hash_resize(hash_mb)) {
+            fprintf(stderr, "%s: can't allocate %zu MB hash table\n",
+                    argv[0], hash_mb);
+            return 1;
+        }
+        run_bench(depth);
+        return 0;
+    }
+
+    /* handle command-line options */
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--fen") == 0 && i + 1 < argc) {
+            fen = argv[++i];
+        }
+        else if(strcmp(argv[i], "--hash") == 0 && i + 1 < argc) {
+            if(!(hash_mb = parse_mb(argv[++i]))) {
+                fprintf(stderr, "%s: invalid hash size: %s\n", argv[0],
+                        argv[i]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            if(!(threads = parse_count(argv[++i], MAX_THREADS))) {
+                usage(argv[0]);
+                return 1;
+            }
+            set_threads(threads);
+        }
+        else if(strcmp(argv[i], "--option") == 0 && i + 1 < argc) {
+            if(!set_option(argv[++i])) {
+                fprintf(stderr, "%s: unknown option: %s\n", argv[0], argv[i]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--root-moves") == 0) {
+            show_root_moves = 1;
+        }
+        else if(strcmp(argv[i], "--perft") == 0 && i + 1 < argc) {
+            perft_depth = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--divide") == 0 && i + 1 < argc) {
+            perft_depth = atoi(argv[++i]);
+            divide = 1;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* allocate the transposition table */
+    if(!hash_resize(hash_mb)) {
+        fprintf(stderr, "%s: can't allocate %zu MB hash table\n", argv[0],
+                hash_mb);
+        return 1;
+    }
+
+    /* start from the given position, waiting for "go" before playing in it
+     * whichever side is on move.
+     */
+    if(fen) {
+        if(!load_fen(&game, fen)) {
+            fprintf(stderr, "%s: invalid FEN: %s\n", argv[0], fen);
+            return 1;
+        }
+        game.engine = FORCE;
+    }
+
+    /* count move generation nodes and exit without talking to xboard */
+    if(perft_depth) {
+        run_perft(&game, perft_depth, divide);
+        return 0;
+    }
+
     /* let xboard know that we are done initialising */
+    puts("feature setboard=1 memory=1 smp=1");
+    announce_options();
     puts("feature done=1");
 
     /* repeatedly handle commands from xboard */
@@ -157,9 +400,36 @@ int main(int argc, char **argv) {
         if(line[strlen(line) - 1] == '\n')
             line[strlen(line) - 1] = '\0';
 
+        /* the clocks arrive before the opponent's move, which is either the
+         * one we were pondering on or ends pondering, as does anything else.
+         */
+        if(pondermove != NOMOVE && strncmp(line, "time ", 5) != 0
+                && strncmp(line, "otim ", 5) != 0) {
+            if(is_xboard_move(line)
+                    && get_xboard_move(&game, line) == pondermove)
+                hit = 1;
+            else
+                stop_background();
+            pondermove = NOMOVE;
+        }
+
+        /* anything but a status request may change what is to be analysed,
+         * so the analysis stops, and starts again once it is handled
+         */
+        if(analysing && strcmp(line, ".") != 0) {
+            stop_background();
+            analysing = 0;
+        }
+
         if(strcmp(line, "new") == 0) {
             /* start a new game */
             reset_game(&game);
+            hash_clear();
+
+            /* the clocks start again, and any depth limit is removed */
+            time_control.time = time_control.otime = time_control.base;
+            time_control.depth = MAX_DEPTH;
+            time_control.moves = 0;
         }
         else if(strcmp(line, "force") == 0) {
             /* enter force mode where we just ensure that moves are valid */
@@ -177,20 +447,104 @@ int main(int argc, char **argv) {
             /* turn off thinking output */
             post = 0;
         }
+        else if(strcmp(line, "hard") == 0) {
+            /* think on the opponent's time */
+            ponder = 1;
+        }
+        else if(strcmp(line, "easy") == 0) {
+            /* don't think on the opponent's time */
+            ponder = 0;
+        }
+        else if(strcmp(line, "analyze") == 0) {
+            /* analyse each position we are given until told to exit */
+            analyze = 1;
+            game.engine = FORCE;
+        }
+        else if(strcmp(line, "exit") == 0) {
+            /* leave analyze mode, in force mode */
+            analyze = 0;
+            game.engine = FORCE;
+        }
+        else if(strcmp(line, ".") == 0) {
+            /* tell xboard how the analysis is going */
+            if(analysing)
+                analysis_status();
+        }
+        else if(strcmp(line, "stats") == 0) {
+            /* show how the last search went */
+            print_stats();
+        }
         else if(strcmp(line, "edit") == 0) {
             /* enter edit mode */
             edit_mode(&game);
         }
+        else if(strncmp(line, "setboard ", 9) == 0) {
+            /* set up the given position, keeping the engine's colour */
+            if(load_fen(&game2, line + 9)) {
+                game2.engine = game.engine;
+                game = game2;
+            }
+            else
+                printf("tellusererror Illegal position\n");
+        }
+        else if(strncmp(line, "level ", 6) == 0) {
+            /* play a number of moves in a time with an increment */
+            set_level(line + 6);
+        }
+        else if(strncmp(line, "st ", 3) == 0) {
+            /* take the given number of seconds for every move */
+            time_control.fixed = atof(line + 3) * 1000;
+        }
+        else if(strncmp(line, "sd ", 3) == 0) {
+            /* search no deeper than the given number of plies */
+            time_control.depth = atoi(line + 3);
+            if(time_control.depth < 1)
+                time_control.depth = 1;
+            if(time_control.depth > MAX_DEPTH)
+                time_control.depth = MAX_DEPTH;
+        }
+        else if(strncmp(line, "time ", 5) == 0) {
+            /* our clock, in centiseconds */
+            time_control.time = atoi(line + 5) * 10;
+        }
+        else if(strncmp(line, "otim ", 5) == 0) {
+            /* our opponent's clock, in centiseconds */
+            time_control.otime = atoi(line + 5) * 10;
+        }
+        else if(strncmp(line, "option ", 7) == 0) {
+            /* change one of the search options */
+            if(!set_option(line + 7))
+                printf("Error (unknown option): %s\n", line + 7);
+        }
+        else if(strncmp(line, "memory ", 7) == 0) {
+            /* resize the hash table to the given number of megabytes */
+            if(!parse_mb(line + 7))
+                printf("Error (bad size): %s\n", line);
+            else if(!hash_resize(parse_mb(line + 7)))
+                printf("Error (cannot allocate): %s\n", line);
+        }
+        else if(strncmp(line, "cores ", 6) == 0) {
+            /* search with the given number of threads */
+            set_threads(atoi(line + 6));
+        }
+        else if(strncmp(line, "perft ", 6) == 0) {
+            /* count the leaf nodes of the move generation tree */
+            run_perft(&game, atoi(line + 6), 0);
+        }
+        else if(strncmp(line, "divide ", 7) == 0) {
+            /* count the leaf nodes below each move */
+            run_perft(&game, atoi(line + 7), 1);
+        }
         else if(strcmp(line, "quit") == 0) {
             printf("# Be seeing you...\n");
             exit(0);
         }
         else if(is_xboard_move(line)) {
-            Move m = get_xboard_move(line);
+            Move m = get_xboard_move(&game, line);
 
             /* validate and apply the move */
             if(is_valid_move(game, m, 1)) {
-                apply_move(&game, m);
+                apply_move(&game, m, NULL);
 
                 /* give game information */
                 draw_board(&(game.board));
@@ -199,36 +553,53 @@ int main(int argc, char **argv) {
         }
 
         /* play a move if it is now our turn */
-        if(game.turn == game.engine) {
-            /* find the best move */
-            Move m = best_move(game);
+        if(game.turn == game.engine && !analyze) {
+            /* find the best move, or finish the search we started while
+             * the opponent was thinking
+             */
+            Move m = hit ? ponder_hit() : best_move(game);
+            hit = 0;
             /* only do anything if we have a legal move */
-            if(m.begin != 64) {
-                apply_move(&game, m);
+            if(m != NOMOVE) {
+                apply_move(&game, m, NULL);
+                time_control.moves++;
 
                 /* give game information */
                 draw_board(&(game.board));
                 printf("# current eval = %d\n", -game.eval);
 
                 /* tell xboard about our move */
-                printf("move %s\n", xboard_move(m));
-                printf("# ! move %s\n", xboard_move(m));
+                printf("move %s\n", xboard_move(m, strmove));
+                printf("# ! move %s\n", strmove);
 
                 /* claim victory or draw if our opponent has no response */
-                MoveScore response = alphabeta(game, -INFINITY, INFINITY, 1);
-                printf("best response score = %d (move = %s)\n", response.score, xboard_move(response.move));
-                if(response.move.begin == 64) {
-                    if(response.score == 0)
+                Move moves[MAX_MOVES];
+                int nmoves;
+                int in_check = generate_movelist(&game, moves, &nmoves);
+                if(nmoves == 0) {
+                    if(!in_check)
                         printf("1/2-1/2 {Stalemate}\n");
-                    else /* response.score == -INFINITY */ {
+                    else {
                         if(game.turn == WHITE)
                             printf("0-1 {Black mates}\n");
                         else
                             printf("1-0 {White mates}\n");
                     }
                 }
+                else if(repetitions(&game) >= 2)
+                    printf("1/2-1/2 {Draw by repetition}\n");
+                else if(game.quiet_moves >= 100)
+                    printf("1/2-1/2 {Draw by fifty move rule}\n");
+
+                /* think about our next move while the opponent thinks */
+                if(ponder && nmoves > 0)
+                    pondermove = start_pondering(game);
             }
         }
+
+        /* analyse the current position in the background */
+        if(analyze && !analysing)
+            analysing = start_analysis(game);
     }
 
     return 0;
@@ -6,6 +6,7 @@
 #ifndef ZOE_H_INC
 #define ZOE_H_INC
 
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <stdint.h>
@@ -29,13 +30,67 @@
 #define OCCUPIED 6
 #define EMPTY    7
 
+#define FILE_A 0x0101010101010101ull
+#define FILE_H 0x8080808080808080ull
+#define RANK_1 0x00000000000000ffull
+#define RANK_3 0x0000000000ff0000ull
+#define RANK_6 0x0000ff0000000000ull
+#define RANK_8 0xff00000000000000ull
+
 #define EXACTLY 0
 #define ATLEAST 1
 #define ATMOST  2
 
-#define INFINITY (1 << 30)
+/* small enough that scores fit in the 16 bits of a hash entry */
+#define INFINITY 30000
+
+/* the hash table has a power of two number of buckets of HT_BUCKET entries,
+ * using HT_DEFAULT_MB megabytes unless told otherwise, and never more than
+ * HT_MAX_MB.
+ */
+#define HT_DEFAULT_MB 64
+#define HT_MAX_MB     (1 << 20)
+#define HT_BUCKET     4
+
+#define MAX_MOVES 256
+
+#define MAX_THREADS 64
+#define MAX_PLY     128
+#define MAX_DEPTH   64
+
+/* keys of earlier positions kept for repetition detection; this must be
+ * more than the largest possible quiet_moves.
+ */
+#define KEY_HISTORY 256
+
+/* history scores, which order the quiet moves, stay below this */
+#define HISTORY_MAX (1 << 27)
+
+/* move types, in the top 4 bits of a move; CAPTURE is set for every
+ * capture and PROMOTION for every promotion, whose low 2 bits give the piece
+ * promoted to, less KNIGHT.
+ */
+#define QUIET_MOVE   0
+#define DOUBLE_PUSH  1
+#define KING_CASTLE  2
+#define QUEEN_CASTLE 3
+#define CAPTURE      4
+#define EP_CAPTURE   5
+#define PROMOTION    8
+
+/* a1 to a1 is never a legal move, so 0 means no move */
+#define NOMOVE 0
+
+#define MOVE(begin, end, type) \
+    ((Move)((begin) | ((end) << 6) | ((type) << 12)))
+#define MOVE_BEGIN(m)    ((m) & 0x3f)
+#define MOVE_END(m)      (((m) >> 6) & 0x3f)
+#define MOVE_TYPE(m)     ((m) >> 12)
+#define IS_CAPTURE(m)    (MOVE_TYPE(m) & CAPTURE)
+#define IS_PROMOTION(m)  (MOVE_TYPE(m) & PROMOTION)
 
-#define HT_SIZE (1 << 22)
+/* the piece the move promotes to, or 0 if it isn't a promotion */
+#define PROMOTE_PIECE(m) (IS_PROMOTION(m) ? (MOVE_TYPE(m) & 3) + KNIGHT : 0)
 
 typedef struct Board {
     uint8_t mailbox[64];
@@ -52,13 +107,24 @@ typedef struct Game {
     uint8_t engine;
     uint8_t ep;
     int eval;
+    uint64_t keys[KEY_HISTORY];
+    unsigned nkeys;
 } Game;
 
-typedef struct Move {
-    uint8_t begin;
-    uint8_t end;
-    uint8_t promote;
-} Move;
+/* the begin tile in bits 0-5, the end tile in bits 6-11 and the type in
+ * bits 12-15
+ */
+typedef uint16_t Move;
+
+/* what unmake_move() needs to take back a move */
+typedef struct Undo {
+    uint8_t captured;
+    uint8_t can_castle[2][2];
+    uint8_t quiet_moves;
+    uint8_t ep;
+    int eval;
+    uint64_t zobrist;
+} Undo;
 
 typedef struct MoveScore {
     Move move;
@@ -66,22 +132,106 @@ typedef struct MoveScore {
     Move pv[16];
 } MoveScore;
 
+/* a 16 byte hash entry; data packs the best move, score, depth, bound type
+ * and age together, and key is stored xor data so that an entry torn
+ * by threads writing at the same time never matches.
+ */
 typedef struct HashEntry {
     uint64_t key;
-    uint8_t depth;
-    uint8_t type;
-    uint8_t colour;
-    MoveScore move;
+    uint64_t data;
 } HashEntry;
 
-/* bitscan.c */
-int bsf(uint64_t n);
-int bsr(uint64_t n);
-int count_ones(uint64_t n);
+/* a bucket of entries filling one 64 byte cache line */
+typedef struct HashBucket {
+    HashEntry entry[HT_BUCKET];
+} __attribute__((aligned(64))) HashBucket;
+
+/* the xboard time control; times are in milliseconds */
+typedef struct TimeControl {
+    int moves_per_session; /* 0 if the whole game is one session */
+    int base;
+    int increment;
+    int fixed;             /* time for every move from st, or 0 */
+    int depth;             /* depth limit from sd */
+    int time;              /* what is left on our clock */
+    int otime;             /* and on our opponent's */
+    int moves;             /* moves we have played since the start */
+} TimeControl;
+
+/* search parameters that can be changed at runtime, for testing */
+typedef struct SearchOptions {
+    int null_move;      /* 1 to use null move pruning */
+    int null_reduction; /* depth taken off a null move search */
+    int lmr;            /* 1 to use late move reductions */
+    int lmr_depth;      /* least depth at which moves are reduced, >= 2 */
+    int lmr_moves;      /* moves searched in full before any are reduced */
+} SearchOptions;
+
+/* counts of what the search did, kept by each thread */
+typedef struct SearchStats {
+    uint64_t nodes;
+    uint64_t qnodes;
+    uint64_t tt_probes;
+    uint64_t tt_hits;       /* probes that found the position */
+    uint64_t tt_cutoffs;    /* hits that gave a score to return */
+    uint64_t tt_overwrites; /* stores that replaced another position */
+    uint64_t cutoffs;       /* beta cutoffs in the move loop */
+    uint64_t first_cutoffs; /* those by the first move searched */
+} SearchStats;
+
+/* the state owned by each search thread */
+typedef struct SearchThread {
+    Game game;
+    int id;
+    SearchStats stats;
+    int ply;
+    uint8_t null_move[MAX_PLY]; /* set where the move to a ply was null */
+    Move killer[MAX_PLY][2];
+    int history[2][64][64];
+    pthread_t thread;
+} SearchThread;
+
+/* the moves of one node, handed out by next_move() in stages: the hash move,
+ * the captures, the killer moves and then the quiet moves, with each stage
+ * only generated if the ones before it didn't cause a cut-off.
+ */
+typedef struct MovePicker {
+    Move moves[MAX_MOVES];
+    int score[MAX_MOVES];
+    int nmoves;
+    int next;
+    int stage;
+    Move hashmove;
+    Move killer[2];
+} MovePicker;
+
+/* bench.c */
+extern const char *bench_fens[];
+
+uint64_t run_bench(int depth);
+
+/* bit operations; these are inline so that the compiler can use tzcnt,
+ * lzcnt and popcnt where the target has them, and move them out of loops.
+ * bsf() and bsr() return 64 for an empty set, which tzcnt does for free.
+ */
+static inline int bsf(uint64_t n) {
+    return n ? __builtin_ctzll(n) : 64;
+}
+
+static inline int bsr(uint64_t n) {
+    return n ? 63 - __builtin_clzll(n) : 64;
+}
+
+static inline int count_ones(uint64_t n) {
+    return __builtin_popcountll(n);
+}
 
 /* board.c */
 extern uint64_t king_moves[64];
 extern uint64_t knight_moves[64];
+extern uint64_t pawn_attacks[2][64];
+extern uint64_t between[64][64];
+extern uint64_t line[64][64];
 
 void reset_board(Board *board);
 void clear_board(Board *board);
@@ -89,39 +239,83 @@ int consistent_board(Board *board);
 void draw_board(Board *board);
 void draw_bitboard(uint64_t board);
 void generate_movetables(void);
+uint64_t rook_attacks(int tile, uint64_t occupied);
+uint64_t bishop_attacks(int tile, uint64_t occupied);
 uint64_t rook_moves(Board *board, int tile);
 uint64_t bishop_moves(Board *board, int tile);
 uint64_t pawn_moves(Board *board, int tile);
+uint64_t attackers(Board *board, int tile, int colour, uint64_t occupied);
+int is_attacked(Board *board, int tile, int colour);
 int is_threatened(Board *board, int tile);
 int king_in_check(Board *board, int colour);
 
 /* game.c */
 void reset_game(Game *game);
+int load_fen(Game *game, const char *fen);
+int repetitions(Game *game);
+int is_draw(Game *game);
 
 /* hash.c */
-extern uint64_t zobrist[8][64];
+extern uint64_t zobrist[2][6][64];
+extern uint64_t zobrist_turn;
+extern uint64_t zobrist_castle[16];
+extern uint64_t zobrist_ep[8];
 
 void init_zobrist(void);
-void hash_store(uint64_t key, uint8_t depth, uint8_t type, MoveScore move,
-        int colour);
+uint64_t compute_zobrist(Game *game);
+int hash_resize(size_t mb);
+void hash_clear(void);
+void hash_new_search(void);
+int hash_store(uint64_t key, uint8_t depth, uint8_t type, MoveScore move,
+        int ply);
 MoveScore hash_retrieve(uint64_t key, uint8_t depth, int alpha, int beta,
-        int colour);
+        int ply, Move *hint);
 
 /* move.c */
-char *xboard_move(Move m);
+extern int piece_score[6];
+
+char *xboard_move(Move m, char *move);
 int is_xboard_move(const char *move);
-Move get_xboard_move(const char *move);
-void apply_move(Game *game, Move m);
-void generate_movelist(Game *game, Move *moves, int *nmoves);
+Move get_xboard_move(Game *game, const char *move);
+Move make_move(Game *game, int begin, int end, int promote);
+int castle_rights(Game *game);
+void apply_move(Game *game, Move m, Undo *undo);
+void unmake_move(Game *game, Move m, Undo *undo);
+void apply_null_move(Game *game, Undo *undo);
+void unmake_null_move(Game *game, Undo *undo);
+int generate_movelist(Game *game, Move *moves, int *nmoves);
+int generate_captures(Game *game, Move *moves, int *nmoves);
+int generate_quiets(Game *game, Move *moves, int *nmoves);
+int is_legal_move(Game *game, Move m);
 uint64_t generate_moves(Game *game, int tile);
+int see(Game *game, Move m);
 int is_valid_move(Game game, Move m, int print);
 int piece_square_score(int piece, int square, int colour);
 
-/* search.c */
-MoveScore alphabeta(Game game, int alpha, int beta, int depth);
-Move best_move(Game game);
+/* perft.c */
+uint64_t perft(Game *game, int depth);
+uint64_t run_perft(Game *game, int depth, int divide);
 
-/* zoe.c */
+/* search.c */
+extern int search_threads;
 extern int post;
+extern int show_root_moves;
+extern SearchOptions search_options;
+extern int json_stats;
+extern TimeControl time_control;
+
+int64_t now_ms(void);
+
+MoveScore alphabeta(SearchThread *t, Game *game, int alpha, int beta,
+        int depth);
+void set_threads(int n);
+Move best_move(Game game);
+Move start_pondering(Game game);
+Move ponder_hit(void);
+int start_analysis(Game game);
+void analysis_status(void);
+void stop_background(void);
+void print_stats(void);
+SearchStats bench_search(Game game, int depth);
 
 #endif